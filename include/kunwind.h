@@ -4,12 +4,268 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
+/* Why an unwind stopped, in the status of the backtrace */
+#define KUNWIND_BT_COMPLETE	0	/* reached the outermost frame */
+#define KUNWIND_BT_TRUNCATED	1	/* max_entries reached */
+#define KUNWIND_BT_NO_MODULE	2	/* pc out of any usable module */
+#define KUNWIND_BT_NO_FDE	3	/* no unwind info for the pc */
+#define KUNWIND_BT_BAD_CFI	4	/* invalid or unsupported CFI */
+#define KUNWIND_BT_FAULT	5	/* the user stack couldn't be read */
+#define KUNWIND_BT_NOT_LOADED	6	/* module not loaded yet */
+
 struct kunwind_backtrace {
 	__u32 max_entries;
-	__u32 nr_entries;
+	__u32 nr_entries;	/* depth reached */
 	__u64 *entries;
+	__u32 status;		/* KUNWIND_BT_* */
+	__u32 __reserved;
 };
 
 #define KUNWIND_UNWIND_IOCTL _IO(0xF6, 0x92)
 
+/* Counters of the per-process unwind rule cache */
+struct kunwind_cache_stats {
+	__u64 hits;
+	__u64 misses;
+	__u64 evictions;
+	__u32 nr_entries;
+	__u32 max_entries;
+};
+
+#define KUNWIND_CACHE_STATS_IOCTL _IO(0xF6, 0x93)
+
+/*
+ * Ring buffer of backtrace records, mmap-ed from /proc/kunwind_debug
+ * once created with KUNWIND_RING_IOCTL. The mapping starts with a page
+ * holding the header, followed by data_size bytes of records. head and
+ * tail are byte counters, modulo data_size they give the position in
+ * the data area. The kernel only advances head, user space only
+ * advances tail once it consumed the records.
+ */
+struct kunwind_ring_header {
+	__u64 head;
+	__u64 tail;
+	__u64 lost;		/* records dropped because the ring was full */
+	__u32 data_offset;	/* from the start of the mapping */
+	__u32 data_size;	/* power of two */
+};
+
+/*
+ * Records are 8-byte aligned and never wrap. A record whose size has
+ * KUNWIND_RECORD_PAD set only fills the end of the data area, the next
+ * record starts at its beginning.
+ */
+struct kunwind_record {
+	__u32 size;		/* in bytes, including this header */
+	__u32 tid;
+	__u64 time;		/* ns, local_clock() of the recording CPU */
+	__u32 nr_entries;
+	__u32 stack_id;		/* interned stack, or 0 if entries follow */
+	__u64 entries[0];
+};
+
+#define KUNWIND_RECORD_PAD (1U << 31)
+
+struct kunwind_ring_params {
+	__u32 nr_pages;		/* data pages, power of two */
+	__u32 flags;
+};
+
+/*
+ * Record a backtrace at each syscall entry of the process. The probe is
+ * on the global sys_enter tracepoint: while any ring has this flag,
+ * every syscall of every task of the system takes the slow syscall
+ * path and a lookup of its process.
+ */
+#define KUNWIND_RING_SYSCALLS (1 << 0)
+/* Record stack ids instead of entries, once the stack map is enabled */
+#define KUNWIND_RING_STACK_IDS (1 << 1)
+
+#define KUNWIND_RING_IOCTL _IO(0xF6, 0x94)
+/* Record the backtrace of the caller in the ring */
+#define KUNWIND_RECORD_IOCTL _IO(0xF6, 0x95)
+
+/*
+ * Stack interning: identical backtraces get the same 32-bit id. Ids
+ * start at 1 and are allocated in sequence, user space can fetch the
+ * entries of the ids it didn't see yet with KUNWIND_STACK_GET_IOCTL.
+ */
+#define KUNWIND_STACKMAP_MAX 65536
+
+/* Argument is the maximum number of stacks */
+#define KUNWIND_STACKMAP_IOCTL _IO(0xF6, 0x96)
+/* Unwind the caller and return the id of its stack */
+#define KUNWIND_STACK_ID_IOCTL _IO(0xF6, 0x97)
+
+struct kunwind_stack_query {
+	__u32 id;
+	__u32 max_entries;
+	__u32 nr_entries;
+	__u32 __reserved;
+	__u64 *entries;
+};
+
+#define KUNWIND_STACK_GET_IOCTL _IO(0xF6, 0x98)
+
+/* Reuse the outer frames of the last backtrace of each thread */
+#define KUNWIND_INCREMENTAL_IOCTL _IO(0xF6, 0x99)
+
+struct kunwind_range {
+	__u64 start;
+	__u64 len;
+};
+
+/* Remove the modules mapped in a range of addresses */
+#define KUNWIND_MODULE_REMOVE_IOCTL _IO(0xF6, 0x9b)
+/* Follow the mmap, mprotect and munmap syscalls of the process */
+#define KUNWIND_MODULES_TRACK_IOCTL _IO(0xF6, 0x9c)
+
+/*
+ * Symbolized output: each module mapped in the process gets an id, never
+ * reused. The entries of a backtrace unwound with
+ * KUNWIND_UNWIND_MODOFF_IOCTL are the id of their module and their
+ * offset from its base. Pcs out of any module get the id 0 and keep
+ * their address. Ids must fit above the offset, once a process has
+ * mapped KUNWIND_MODOFF_MAX_ID modules the new ones are refused.
+ */
+#define KUNWIND_MODOFF_SHIFT 48
+#define KUNWIND_MODOFF_MAX_ID ((1U << (64 - KUNWIND_MODOFF_SHIFT)) - 1)
+#define KUNWIND_MODOFF_ID(entry) ((entry) >> KUNWIND_MODOFF_SHIFT)
+#define KUNWIND_MODOFF_OFFSET(entry) \
+	((entry) & ((1ULL << KUNWIND_MODOFF_SHIFT) - 1))
+
+#define KUNWIND_MODULE_PATHLEN 256
+
+struct kunwind_module_desc {
+	__u32 id;
+	__u32 __reserved;
+	__u64 start;		/* vma range of the module */
+	__u64 end;
+	__u64 base;		/* load address, the offsets are from it */
+	__u8 path[KUNWIND_MODULE_PATHLEN];
+};
+
+struct kunwind_module_table {
+	__u32 max_entries;
+	__u32 nr_entries;	/* number of modules, may exceed max_entries */
+	struct kunwind_module_desc *entries;
+};
+
+/* Same as KUNWIND_UNWIND_IOCTL, with module ids and offsets */
+#define KUNWIND_UNWIND_MODOFF_IOCTL _IO(0xF6, 0x9d)
+/* Fetch the modules of the process, arg is a struct kunwind_module_table */
+#define KUNWIND_MODULE_TABLE_IOCTL _IO(0xF6, 0x9e)
+
+/*
+ * Register the calling thread for the unwinds of the file. The thread
+ * that opened the file is registered. The first KUNWIND_UNWIND_IOCTL,
+ * KUNWIND_UNWIND_MODOFF_IOCTL, KUNWIND_RECORD_IOCTL or
+ * KUNWIND_STACK_ID_IOCTL of any other thread registers it and fails
+ * with EAGAIN, as its registers were not saved for the unwind: call this
+ * first, or retry once.
+ */
+#define KUNWIND_THREAD_IOCTL _IO(0xF6, 0x9f)
+
+/*
+ * Profile mode: the recorded backtraces of the process are counted by
+ * stack id instead of being written to the ring, which needs the stack
+ * map. User space drains the counts and fetches the entries of the new
+ * ids with KUNWIND_STACK_GET_IOCTL.
+ */
+#define KUNWIND_PROFILE_IOCTL _IO(0xF6, 0xa0)
+
+struct kunwind_stack_count {
+	__u32 id;
+	__u32 __reserved;
+	__u64 count;
+};
+
+struct kunwind_profile_drain {
+	__u32 max_entries;
+	__u32 nr_entries;
+	__u64 lost;		/* samples whose stack could not be interned */
+	struct kunwind_stack_count *entries;
+};
+
+/* Fetch and reset the counts of the stacks recorded since the last drain */
+#define KUNWIND_PROFILE_DRAIN_IOCTL _IO(0xF6, 0xa1)
+
+/*
+ * Compiled unwind tables, saved by user space to skip their compilation
+ * in the next runs, e.g. after a restart or a reboot. The modules of a
+ * process are also kept loaded in the kernel for a while after their
+ * last process exits, see the kunw_retained_modules parameter.
+ *
+ * A table starts with the header, followed by nr_rows rows sorted by
+ * start and nr_nofp ranges. The pcs are relative to the module bias.
+ */
+#define KUNWIND_TABLE_MAGIC	0x4b555442	/* "KUTB" */
+#define KUNWIND_TABLE_VERSION	1
+#define KUNWIND_BUILD_ID_SIZE	20
+
+/* The module is built with frame pointers, the nofp ranges follow */
+#define KUNWIND_TABLE_FP	(1 << 0)
+
+struct kunwind_table_header {
+	__u32 magic;
+	__u16 version;
+	__u8 compat;
+	__u8 build_id_len;
+	__u8 build_id[KUNWIND_BUILD_ID_SIZE];
+	__u64 ehf_size;		/* eh_frame the table was compiled from */
+	__u32 nr_rows;
+	__u32 nr_nofp;
+	__u32 flags;		/* KUNWIND_TABLE_* */
+	__u32 __reserved;
+};
+
+/* Rule of a register, where is a kernel internal location type */
+struct kunwind_table_rule {
+	__s32 where;
+	__s32 reg;
+	__s64 off;
+};
+
+struct kunwind_table_row {
+	__u64 start;
+	__u64 end;
+	struct kunwind_table_rule cfa;
+	struct kunwind_table_rule fp;
+	struct kunwind_table_rule sp;
+	struct kunwind_table_rule ra;
+	__s32 cond_reg;		/* conditional term of a cfa expression */
+	__u8 cond_mask;
+	__u8 cond_ge;
+	__u8 cond_shift;
+	__u8 last;		/* outermost frame */
+};
+
+/* Function that doesn't set up a frame pointer */
+struct kunwind_table_range {
+	__u64 start;
+	__u64 end;
+};
+
+struct kunwind_table_blob {
+	__u32 id;		/* of the module, see KUNWIND_MODULE_TABLE_IOCTL */
+	__u32 size;		/* of buf, set to the size of the table */
+	__u8 build_id[KUNWIND_BUILD_ID_SIZE];	/* set by both ioctls */
+	__u32 build_id_len;	/* 0 if the module has none */
+	__u32 __reserved;
+	void *buf;
+};
+
+/*
+ * Copy the table of a module, compiling it if needed. Fails with
+ * -ENOSPC if buf is too small, with the size needed. A NULL buf only
+ * loads the module and returns its build id.
+ */
+#define KUNWIND_TABLE_EXPORT_IOCTL _IO(0xF6, 0xa2)
+/*
+ * Use a saved table instead of compiling it, needs CAP_SYS_ADMIN as
+ * the module is shared with the other processes. The build id of the
+ * module must match. Fails with -EEXIST if the module has a table.
+ */
+#define KUNWIND_TABLE_IMPORT_IOCTL _IO(0xF6, 0xa3)
+
 #endif // _UAPI_KUNWIND_H_
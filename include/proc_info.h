@@ -20,12 +20,23 @@ struct load_info {
 	__u8 path[LINFO_PATHLEN];
 };
 
+/* proc_info flags */
+#define KUNWIND_PINFO_COMPILE	(1 << 0) /* compile the unwind tables eagerly */
+
 struct proc_info {
 	__u32 size;
 	__u32 nr_load_segments;
+	__u32 flags;
+	__u32 __reserved;
 	struct load_info load_segments[0];
 };
 
+/* Bytes of a proc_info of nr objects */
+#define PROC_INFO_SIZE(nr) \
+	(sizeof(struct proc_info) + (nr) * sizeof(struct load_info))
+
 #define KUNWIND_PROC_INFO_IOCTL _IO(0xF6, 0x91)
+/* Add a single module, arg is a struct load_info */
+#define KUNWIND_MODULE_ADD_IOCTL _IO(0xF6, 0x9a)
 
 #endif // _UAPI_PROC_INFO_H_
@@ -3,8 +3,14 @@
 
 #include <proc_info.h>
 
+#include <stddef.h>
+
 #define ERR_NO_EH_PHDR 1
 
+/* Objects in the first allocation of find_proc_info() */
+#define PROC_INFO_GUESS 64
+
+int find_proc_info_into(struct proc_info *proc_info, size_t size);
 struct proc_info *find_proc_info(void);
 
 #endif // _FIND_PROC_INFO_H_
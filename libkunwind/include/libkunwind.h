@@ -4,9 +4,11 @@
 #include "kunwind.h"
 #include "proc_info.h"
 
+#include <stdint.h>
 #include <stdio.h>
 
 struct kunwind_handle;
+struct kunwind_ring;
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,11 +22,83 @@ int kunwind_open(struct kunwind_handle **handle);
 int kunwind_init_proc_info(struct kunwind_handle **handle,
 		struct proc_info *proc_info);
 
+int kunwind_proc_info_fill(struct proc_info *proc_info, size_t size);
+
+int kunwind_open_buf(struct kunwind_handle **handle,
+		struct proc_info *proc_info, size_t size);
+
+int kunwind_fd(struct kunwind_handle *handle);
+
+struct kunwind_handle *kunwind_thread_handle(void);
+
 int kunwind_backtrace(struct kunwind_handle *handle,
 	   struct kunwind_backtrace *backtrace);
 
+int kunwind_backtrace_into(struct kunwind_handle *handle, uint64_t *buf,
+		unsigned int n);
+
+int kunwind_backtrace_modoff(struct kunwind_handle *handle,
+	   struct kunwind_backtrace *backtrace);
+
+int kunwind_module_table(struct kunwind_handle *handle,
+		struct kunwind_module_desc *descs, unsigned int max);
+
 void kunwind_close(struct kunwind_handle *handle);
 
+int kunwind_ring_open(struct kunwind_handle *handle, unsigned int nr_pages,
+		unsigned int flags, struct kunwind_ring **ring);
+
+int kunwind_record(struct kunwind_handle *handle);
+
+typedef void (*kunwind_record_cb)(const struct kunwind_record *record,
+		void *data);
+
+int kunwind_ring_consume(struct kunwind_ring *ring, kunwind_record_cb cb,
+		void *data);
+
+unsigned long long kunwind_ring_lost(struct kunwind_ring *ring);
+
+void kunwind_ring_close(struct kunwind_ring *ring);
+
+int kunwind_module_add(struct kunwind_handle *handle,
+		struct load_info *linfo);
+
+int kunwind_module_remove(struct kunwind_handle *handle, unsigned long start,
+		unsigned long len);
+
+int kunwind_modules_update(struct kunwind_handle *handle);
+
+int kunwind_modules_track(struct kunwind_handle *handle);
+
+int kunwind_incremental_enable(struct kunwind_handle *handle);
+
+int kunwind_stackmap_enable(struct kunwind_handle *handle,
+		unsigned int max_stacks);
+
+int kunwind_backtrace_id(struct kunwind_handle *handle);
+
+int kunwind_stack_get(struct kunwind_handle *handle, unsigned int id,
+		struct kunwind_backtrace *backtrace);
+
+int kunwind_profile_enable(struct kunwind_handle *handle,
+		unsigned int max_stacks);
+
+int kunwind_profile_drain(struct kunwind_handle *handle,
+		struct kunwind_stack_count *counts, unsigned int max,
+		unsigned long long *lost);
+
+int kunwind_profile_folded(struct kunwind_handle *handle, FILE *out);
+
+int kunwind_table_export(struct kunwind_handle *handle, unsigned int id,
+		void **buf, size_t *size);
+
+int kunwind_table_import(struct kunwind_handle *handle, unsigned int id,
+		const void *buf, size_t size);
+
+int kunwind_tables_save(struct kunwind_handle *handle, const char *dir);
+
+int kunwind_tables_restore(struct kunwind_handle *handle, const char *dir);
+
 #ifdef __cplusplus
 }
 #endif
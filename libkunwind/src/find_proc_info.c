@@ -3,17 +3,14 @@
 #include <link.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 
 #include "find_proc_info.h"
 
-struct load_info_list {
-	struct load_info info;
-	struct load_info_list *next;
-};
-
 struct extract_unwind_info_data {
-	struct load_info_list *list_head;
-	struct load_info_list *list_tail;
+	struct load_info *load_segments;
+	size_t max_load_segments;
 	size_t nr_load_segments;
 };
 
@@ -42,62 +39,74 @@ static int extract_unwind_info(struct dl_phdr_info *info,
 	if (!eh_phdr)
 		return -ERR_NO_EH_PHDR;
 
-	// Fill data
-	struct load_info_list *elem = malloc(sizeof(struct load_info_list));
-	ElfW(Addr) addr;
-	elem->info.obj_addr = addr = info->dlpi_addr;
-	elem->info.eh_frame_hdr_ubuf = addr + eh_phdr->p_vaddr;
-	elem->info.eh_frame_hdr_size = eh_phdr->p_memsz;
-	elem->info.dynamic = dynamic;
-	elem->next = NULL;
-
-	// Add to list
-	if (!extract_data->list_head) {
-		extract_data->list_head =
-			extract_data->list_tail = elem;
-		extract_data->nr_load_segments = 1;
-	} else {
-		extract_data->list_tail->next = elem;
-		extract_data->list_tail = elem;
-		extract_data->nr_load_segments++;
+	// Fill data, only count the objects that don't fit
+	if (extract_data->nr_load_segments < extract_data->max_load_segments) {
+		struct load_info *linfo = &extract_data->load_segments[
+			extract_data->nr_load_segments];
+		ElfW(Addr) addr;
+
+		memset(linfo, 0, sizeof(*linfo));
+		linfo->obj_addr = addr = info->dlpi_addr;
+		linfo->eh_frame_hdr_ubuf = addr + eh_phdr->p_vaddr;
+		linfo->eh_frame_hdr_size = eh_phdr->p_memsz;
+		linfo->dynamic = dynamic;
 	}
+	extract_data->nr_load_segments++;
 
 	return 0;
 }
 
-static void free_load_info_list(struct load_info_list *list)
-{
-	struct load_info_list *next = list;
-	do {
-		list = next;
-		next = list->next;
-		free(list);
-	} while (next);
-}
-
-struct proc_info *find_proc_info(void)
+/*
+ * Fill the caller's buffer of size bytes in a single pass over the
+ * loaded objects. Returns the number of objects, which may be greater
+ * than what fits in the buffer, or a negative value on error. The
+ * buffer can be reused for each call.
+ */
+int find_proc_info_into(struct proc_info *proc_info, size_t size)
 {
 	struct extract_unwind_info_data data = { 0 };
-	int err = dl_iterate_phdr(extract_unwind_info, (void *) &data);
+	int err;
 
-	if (err) {
-		free_load_info_list(data.list_head);
-		return NULL;
-	}
+	if (size < sizeof(struct proc_info))
+		return -EINVAL;
 
-	size_t proc_info_size = sizeof(struct proc_info) +
-		data.nr_load_segments * sizeof(struct load_info);
-	struct proc_info *proc_info = malloc(proc_info_size);
+	data.load_segments = proc_info->load_segments;
+	data.max_load_segments = (size - sizeof(struct proc_info)) /
+		sizeof(struct load_info);
+	err = dl_iterate_phdr(extract_unwind_info, (void *) &data);
+	if (err)
+		return err;
 
-	// Fill info
-	proc_info->size = proc_info_size;
+	// Fill the header with the entries filled in
 	proc_info->nr_load_segments = data.nr_load_segments;
-	struct load_info_list *elem = data.list_head;
-	struct load_info *linfo = proc_info->load_segments;
-	for (; elem; elem = elem->next, ++linfo) {
-		*linfo = elem->info;
-	}
+	if (proc_info->nr_load_segments > data.max_load_segments)
+		proc_info->nr_load_segments = data.max_load_segments;
+	proc_info->size = PROC_INFO_SIZE(proc_info->nr_load_segments);
+	proc_info->flags = 0;
+	proc_info->__reserved = 0;
+	return data.nr_load_segments;
+}
+
+struct proc_info *find_proc_info(void)
+{
+	size_t nr = PROC_INFO_GUESS;
+	struct proc_info *proc_info = NULL;
+	int ret;
+
+	// Objects can be loaded between two passes, retry until they fit
+	do {
+		free(proc_info);
+		proc_info = malloc(PROC_INFO_SIZE(nr));
+		if (proc_info == NULL)
+			return NULL;
+		ret = find_proc_info_into(proc_info, PROC_INFO_SIZE(nr));
+		if (ret < 0) {
+			free(proc_info);
+			return NULL;
+		}
+		if ((size_t) ret > nr)
+			nr = ret + PROC_INFO_GUESS;
+	} while ((size_t) ret > proc_info->nr_load_segments);
 
-	free_load_info_list(data.list_head);
 	return proc_info;
 }
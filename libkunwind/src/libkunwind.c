@@ -3,16 +3,37 @@
 #include "autoconf.h"
 
 #include "libkunwind.h"
+#include "find_proc_info.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 struct kunwind_handle {
-	FILE *fd;
+	int fd;
+	struct proc_info *modules;	/* at the last kunwind_modules_update() */
+	/* entries of the interned stacks, by id - 1, see kunwind_profile_folded() */
+	struct kunwind_backtrace **stacks;
+	unsigned int nr_stacks;
+};
+
+/* Handles of the threads, see kunwind_thread_handle() */
+static __thread struct kunwind_handle *thread_handle;
+static pthread_key_t thread_handle_key;
+static pthread_once_t thread_handle_once = PTHREAD_ONCE_INIT;
+
+struct kunwind_ring {
+	struct kunwind_ring_header *header;
+	char *data;
+	size_t size;
 };
 
 struct kunwind_backtrace *kunwind_backtrace_new(int max_entries)
@@ -53,37 +74,672 @@ int kunwind_init_proc_info(struct kunwind_handle **handle,
 {
 	int ret = 0;
 
-	FILE *fd = fopen("/proc/kunwind_debug", "r+");
-	if (fd == NULL) {
+	int fd = open("/proc/kunwind_debug", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
 		printf("errno=%d\n", errno);
 		return errno;
 	}
 
-	ret = ioctl(fileno(fd), KUNWIND_PROC_INFO_IOCTL, proc_info);
+	ret = ioctl(fd, KUNWIND_PROC_INFO_IOCTL, proc_info);
 	if (ret < 0) {
+		close(fd);
 		return ret;
 	}
 
 	*handle = calloc(1, sizeof(struct kunwind_handle));
 	if (*handle == NULL) {
-		fclose(fd);
+		close(fd);
 		return -ENOMEM;
 	}
 	(*handle)->fd = fd;
 	return ret;
 }
 
+/*
+ * Describe the loaded objects in the caller's buffer of size bytes,
+ * see PROC_INFO_SIZE(). The buffer can be reused, nothing is
+ * allocated. Returns the number of objects, greater than
+ * proc_info->nr_load_segments if they didn't all fit.
+ */
+int kunwind_proc_info_fill(struct proc_info *proc_info, size_t size)
+{
+	return find_proc_info_into(proc_info, size);
+}
+
+/* Open with the objects filled in the caller's buffer */
+int kunwind_open_buf(struct kunwind_handle **handle,
+		struct proc_info *proc_info, size_t size)
+{
+	int ret;
+
+	ret = find_proc_info_into(proc_info, size);
+	if (ret < 0)
+		return ret;
+	if ((unsigned int) ret > proc_info->nr_load_segments)
+		return -ENOSPC;
+	return kunwind_init_proc_info(handle, proc_info);
+}
+
+/* The descriptor of the handle, e.g. to issue the ioctls directly */
+int kunwind_fd(struct kunwind_handle *handle)
+{
+	return handle->fd;
+}
+
+/*
+ * The ioctls that unwind the caller. The first one from a thread that
+ * didn't open the handle registers it and fails with EAGAIN, the retry
+ * unwinds.
+ */
+static int unwind_ioctl(struct kunwind_handle *handle, unsigned long cmd,
+		void *arg)
+{
+	int ret;
+
+	ret = ioctl(handle->fd, cmd, arg);
+	if (ret < 0 && errno == EAGAIN)
+		ret = ioctl(handle->fd, cmd, arg);
+	return ret;
+}
+
+static void thread_handle_destroy(void *handle)
+{
+	kunwind_close(handle);
+}
+
+static void thread_handle_key_create(void)
+{
+	pthread_key_create(&thread_handle_key, thread_handle_destroy);
+}
+
+/*
+ * The handle of the calling thread, opened at its first call and closed
+ * when it exits, not with kunwind_close(). It shares the modules of the
+ * handle opened with kunwind_open(), which must stay open, so nothing
+ * is loaded again. Threads unwinding with their own handle don't
+ * contend on the reference count of a shared file. Returns NULL on
+ * error.
+ */
+struct kunwind_handle *kunwind_thread_handle(void)
+{
+	struct kunwind_handle *handle;
+	int fd;
+
+	if (thread_handle)
+		return thread_handle;
+
+	if (pthread_once(&thread_handle_once, thread_handle_key_create))
+		return NULL;
+	fd = open("/proc/kunwind_debug", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	/* the process is registered already, only register the thread */
+	if (ioctl(fd, KUNWIND_THREAD_IOCTL, NULL) < 0)
+		goto err;
+	handle = calloc(1, sizeof(struct kunwind_handle));
+	if (handle == NULL)
+		goto err;
+	handle->fd = fd;
+	if (pthread_setspecific(thread_handle_key, handle)) {
+		free(handle);
+		goto err;
+	}
+	thread_handle = handle;
+	return handle;
+
+err:
+	close(fd);
+	return NULL;
+}
+
 int kunwind_backtrace(struct kunwind_handle *handle,
 	   struct kunwind_backtrace* backtrace)
 {
-	return ioctl(fileno(handle->fd), KUNWIND_UNWIND_IOCTL,
-		     backtrace);
+	return unwind_ioctl(handle, KUNWIND_UNWIND_IOCTL, backtrace);
+}
+
+/*
+ * Unwind into the caller's array of n entries, without a struct
+ * kunwind_backtrace to allocate. Returns the depth reached.
+ */
+int kunwind_backtrace_into(struct kunwind_handle *handle, uint64_t *buf,
+		unsigned int n)
+{
+	struct kunwind_backtrace bt = {
+		.max_entries = n,
+		.entries = (__u64 *) buf,
+	};
+	int ret;
+
+	ret = unwind_ioctl(handle, KUNWIND_UNWIND_IOCTL, &bt);
+	if (ret < 0)
+		return ret;
+	return bt.nr_entries;
+}
+
+/*
+ * Same as kunwind_backtrace(), the entries are the ids of the modules
+ * and the offsets from their base, see KUNWIND_MODOFF_ID() and
+ * KUNWIND_MODOFF_OFFSET(). They are resolved offline with the module
+ * table.
+ */
+int kunwind_backtrace_modoff(struct kunwind_handle *handle,
+		struct kunwind_backtrace *bt)
+{
+	return unwind_ioctl(handle, KUNWIND_UNWIND_MODOFF_IOCTL, bt);
+}
+
+/*
+ * Describe at most max modules of the process in descs. Returns the
+ * number of modules, which may be greater than max.
+ */
+int kunwind_module_table(struct kunwind_handle *handle,
+		struct kunwind_module_desc *descs, unsigned int max)
+{
+	struct kunwind_module_table table = {
+		.max_entries = max,
+		.entries = descs,
+	};
+	int ret;
+
+	ret = ioctl(handle->fd, KUNWIND_MODULE_TABLE_IOCTL, &table);
+	if (ret < 0)
+		return ret;
+	return table.nr_entries;
 }
 
 void kunwind_close(struct kunwind_handle *handle)
 {
 	if (handle != NULL) {
-		fclose(handle->fd);
+		close(handle->fd);
+		free(handle->modules);
+		for (unsigned int i = 0; i < handle->nr_stacks; i++)
+			kunwind_backtrace_free(handle->stacks[i]);
+		free(handle->stacks);
 		free(handle);
 	}
 }
+
+/*
+ * Create the ring buffer of the handle and map it. The kernel appends
+ * a record for each kunwind_record() call and, with
+ * KUNWIND_RING_SYSCALLS, at each syscall entry of the process.
+ */
+int kunwind_ring_open(struct kunwind_handle *handle, unsigned int nr_pages,
+		unsigned int flags, struct kunwind_ring **ring)
+{
+	struct kunwind_ring_params params = {
+		.nr_pages = nr_pages,
+		.flags = flags,
+	};
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *addr;
+	int ret;
+
+	ret = ioctl(handle->fd, KUNWIND_RING_IOCTL, &params);
+	if (ret < 0)
+		return ret;
+
+	*ring = calloc(1, sizeof(struct kunwind_ring));
+	if (*ring == NULL)
+		return -ENOMEM;
+
+	(*ring)->size = (size_t) page_size * (nr_pages + 1);
+	addr = mmap(NULL, (*ring)->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    handle->fd, 0);
+	if (addr == MAP_FAILED) {
+		free(*ring);
+		*ring = NULL;
+		return -errno;
+	}
+	(*ring)->header = addr;
+	(*ring)->data = (char *) addr + (*ring)->header->data_offset;
+	return 0;
+}
+
+int kunwind_record(struct kunwind_handle *handle)
+{
+	return unwind_ioctl(handle, KUNWIND_RECORD_IOCTL, NULL);
+}
+
+/*
+ * Call cb for each record available in the ring, then release them to
+ * the kernel. Returns the number of records consumed.
+ */
+int kunwind_ring_consume(struct kunwind_ring *ring, kunwind_record_cb cb,
+		void *data)
+{
+	struct kunwind_ring_header *header = ring->header;
+	unsigned long long head, tail;
+	unsigned int mask = header->data_size - 1;
+	int nr = 0;
+
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	tail = header->tail;
+	while (tail < head) {
+		const struct kunwind_record *rec =
+			(const void *) (ring->data + (tail & mask));
+
+		if (rec->size & KUNWIND_RECORD_PAD) {
+			tail += rec->size & ~KUNWIND_RECORD_PAD;
+			continue;
+		}
+		cb(rec, data);
+		tail += rec->size;
+		nr++;
+	}
+	__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+	return nr;
+}
+
+unsigned long long kunwind_ring_lost(struct kunwind_ring *ring)
+{
+	return __atomic_load_n(&ring->header->lost, __ATOMIC_RELAXED);
+}
+
+void kunwind_ring_close(struct kunwind_ring *ring)
+{
+	if (ring != NULL) {
+		munmap(ring->header, ring->size);
+		free(ring);
+	}
+}
+
+/*
+ * Unwinds of a thread stop at the first frame shared with its last
+ * backtrace and copy the outer frames from it.
+ */
+int kunwind_incremental_enable(struct kunwind_handle *handle)
+{
+	return ioctl(handle->fd, KUNWIND_INCREMENTAL_IOCTL, NULL);
+}
+
+/*
+ * Intern the backtraces of the process: identical stacks get the same
+ * id, in the ring records with KUNWIND_RING_STACK_IDS or from
+ * kunwind_backtrace_id().
+ */
+int kunwind_stackmap_enable(struct kunwind_handle *handle,
+		unsigned int max_stacks)
+{
+	return ioctl(handle->fd, KUNWIND_STACKMAP_IOCTL,
+		     (unsigned long) max_stacks);
+}
+
+/* Returns the id of the stack of the caller */
+int kunwind_backtrace_id(struct kunwind_handle *handle)
+{
+	return unwind_ioctl(handle, KUNWIND_STACK_ID_IOCTL, NULL);
+}
+
+/* Fetch the entries of an interned stack */
+int kunwind_stack_get(struct kunwind_handle *handle, unsigned int id,
+		struct kunwind_backtrace *bt)
+{
+	struct kunwind_stack_query query = {
+		.id = id,
+		.max_entries = bt->max_entries,
+		.entries = bt->entries,
+	};
+	int ret;
+
+	ret = ioctl(handle->fd, KUNWIND_STACK_GET_IOCTL, &query);
+	if (ret < 0)
+		return ret;
+	bt->nr_entries = query.nr_entries;
+	return 0;
+}
+
+/*
+ * Count the recorded backtraces by stack in the kernel instead of
+ * writing them to the ring, with at most max_stacks distinct stacks.
+ */
+int kunwind_profile_enable(struct kunwind_handle *handle,
+		unsigned int max_stacks)
+{
+	int ret;
+
+	ret = kunwind_stackmap_enable(handle, max_stacks);
+	if (ret < 0 && errno != EBUSY)
+		return ret;
+	return ioctl(handle->fd, KUNWIND_PROFILE_IOCTL, NULL);
+}
+
+/*
+ * Fetch and reset the counts of at most max stacks recorded since the
+ * last drain. Returns the number of counts, the samples lost because
+ * the stack map was full are added to lost.
+ */
+int kunwind_profile_drain(struct kunwind_handle *handle,
+		struct kunwind_stack_count *counts, unsigned int max,
+		unsigned long long *lost)
+{
+	struct kunwind_profile_drain drain = {
+		.max_entries = max,
+		.entries = counts,
+	};
+	int ret;
+
+	ret = ioctl(handle->fd, KUNWIND_PROFILE_DRAIN_IOCTL, &drain);
+	if (ret < 0)
+		return ret;
+	if (lost)
+		*lost += drain.lost;
+	return drain.nr_entries;
+}
+
+/* The kernel keeps at most this many frames of a backtrace */
+#define STACK_MAX_ENTRIES 128
+
+/* The entries of a stack, fetched once per id */
+static struct kunwind_backtrace *profile_stack(struct kunwind_handle *handle,
+		unsigned int id)
+{
+	struct kunwind_backtrace **stacks;
+
+	if (id > handle->nr_stacks) {
+		stacks = realloc(handle->stacks, id * sizeof(*stacks));
+		if (stacks == NULL)
+			return NULL;
+		memset(stacks + handle->nr_stacks, 0,
+		       (id - handle->nr_stacks) * sizeof(*stacks));
+		handle->stacks = stacks;
+		handle->nr_stacks = id;
+	}
+	if (handle->stacks[id - 1] == NULL) {
+		struct kunwind_backtrace *bt;
+
+		bt = kunwind_backtrace_new(STACK_MAX_ENTRIES);
+		if (bt == NULL)
+			return NULL;
+		if (kunwind_stack_get(handle, id, bt) < 0) {
+			kunwind_backtrace_free(bt);
+			return NULL;
+		}
+		handle->stacks[id - 1] = bt;
+	}
+	return handle->stacks[id - 1];
+}
+
+/*
+ * Drain the profile to out in the folded format of the flame graph
+ * tools: one line per stack, the pcs from the outermost frame joined
+ * by ';', then the count. Returns the number of stacks written.
+ */
+int kunwind_profile_folded(struct kunwind_handle *handle, FILE *out)
+{
+	struct kunwind_stack_count counts[256];
+	struct kunwind_backtrace *bt;
+	int nr, total = 0;
+
+	do {
+		nr = kunwind_profile_drain(handle, counts, 256, NULL);
+		if (nr < 0)
+			return nr;
+		for (int i = 0; i < nr; i++) {
+			bt = profile_stack(handle, counts[i].id);
+			if (bt == NULL)
+				return -ENOMEM;
+			for (unsigned int j = bt->nr_entries; j-- > 0;)
+				fprintf(out, "0x%llx%s",
+					(unsigned long long) bt->entries[j],
+					j ? ";" : "");
+			fprintf(out, " %llu\n",
+				(unsigned long long) counts[i].count);
+		}
+		total += nr;
+	} while (nr == 256);
+	return total;
+}
+
+/*
+ * Serialize the compiled unwind table of the module id in a buffer
+ * allocated with malloc(), see struct kunwind_table_header. The table
+ * is compiled if it wasn't yet.
+ */
+int kunwind_table_export(struct kunwind_handle *handle, unsigned int id,
+		void **buf, size_t *size)
+{
+	struct kunwind_table_blob blob = { .id = id };
+	void *table = NULL;
+	int ret;
+
+	/* the size is found on the first try, the table may still grow */
+	do {
+		free(table);
+		table = malloc(blob.size ? blob.size : 1);
+		if (table == NULL)
+			return -ENOMEM;
+		blob.buf = table;
+		ret = ioctl(handle->fd, KUNWIND_TABLE_EXPORT_IOCTL, &blob);
+	} while (ret < 0 && errno == ENOSPC);
+	if (ret < 0) {
+		free(table);
+		return ret;
+	}
+	*buf = table;
+	*size = blob.size;
+	return 0;
+}
+
+/* Use a table saved by kunwind_table_export() for the module id */
+int kunwind_table_import(struct kunwind_handle *handle, unsigned int id,
+		const void *buf, size_t size)
+{
+	struct kunwind_table_blob blob = {
+		.id = id,
+		.size = size,
+		.buf = (void *) buf,
+	};
+
+	return ioctl(handle->fd, KUNWIND_TABLE_IMPORT_IOCTL, &blob);
+}
+
+/* Name of the file of a table in dir, from the build id of the module */
+static int table_path(struct kunwind_handle *handle, unsigned int id,
+		const char *dir, char *path, size_t size)
+{
+	struct kunwind_table_blob blob = { .id = id };
+	int len;
+
+	if (ioctl(handle->fd, KUNWIND_TABLE_EXPORT_IOCTL, &blob) < 0)
+		return -1;
+	if (!blob.build_id_len) {
+		errno = ENOENT;
+		return -1;
+	}
+	len = snprintf(path, size, "%s/", dir);
+	for (unsigned int i = 0; i < blob.build_id_len && len < (int) size; i++)
+		len += snprintf(path + len, size - len, "%02x", blob.build_id[i]);
+	if (len >= (int) size
+	    || snprintf(path + len, size - len, ".kut") >= (int) (size - len)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* Ids of the modules of the process, in a buffer allocated with malloc() */
+static int module_ids(struct kunwind_handle *handle,
+		struct kunwind_module_desc **descs)
+{
+	int nr, max = 0;
+
+	*descs = NULL;
+	do {
+		nr = kunwind_module_table(handle, *descs, max);
+		if (nr <= max || nr < 0)
+			break;
+		free(*descs);
+		max = nr;
+		*descs = calloc(max, sizeof(**descs));
+		if (*descs == NULL)
+			return -ENOMEM;
+	} while (1);
+	if (nr < 0) {
+		free(*descs);
+		*descs = NULL;
+	}
+	return nr;
+}
+
+/*
+ * Save the unwind tables of the modules of the process in dir, one file
+ * per build id. Modules without a build id are skipped. Returns the
+ * number of tables saved.
+ */
+int kunwind_tables_save(struct kunwind_handle *handle, const char *dir)
+{
+	struct kunwind_module_desc *descs;
+	char path[PATH_MAX];
+	size_t size;
+	void *table;
+	int nr, saved = 0;
+	FILE *f;
+
+	nr = module_ids(handle, &descs);
+	for (int i = 0; i < nr; i++) {
+		if (table_path(handle, descs[i].id, dir, path, sizeof(path)) < 0
+		    || kunwind_table_export(handle, descs[i].id, &table, &size) < 0)
+			continue;
+		f = fopen(path, "we");
+		if (f != NULL) {
+			int ok = fwrite(table, 1, size, f) == size;
+
+			if (!fclose(f) && ok)
+				saved++;
+		}
+		free(table);
+	}
+	free(descs);
+	return nr < 0 ? nr : saved;
+}
+
+/* Read a whole file in a buffer allocated with malloc() */
+static void *read_file(const char *path, size_t *size)
+{
+	void *buf = NULL;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0
+	    || fseek(f, 0, SEEK_SET))
+		goto out;
+	buf = malloc(len);
+	if (buf != NULL && fread(buf, 1, len, f) != (size_t) len) {
+		free(buf);
+		buf = NULL;
+	}
+	*size = len;
+out:
+	fclose(f);
+	return buf;
+}
+
+/*
+ * Load the tables saved by kunwind_tables_save() for the modules of
+ * the process, instead of compiling them. Needs CAP_SYS_ADMIN. Returns
+ * the number of modules that have a table afterwards.
+ */
+int kunwind_tables_restore(struct kunwind_handle *handle, const char *dir)
+{
+	struct kunwind_module_desc *descs;
+	char path[PATH_MAX];
+	void *table;
+	size_t size;
+	int nr, restored = 0;
+
+	nr = module_ids(handle, &descs);
+	for (int i = 0; i < nr; i++) {
+		if (table_path(handle, descs[i].id, dir, path, sizeof(path)) < 0)
+			continue;
+		table = read_file(path, &size);
+		if (table == NULL)
+			continue;
+		/* a module retained by the kernel already has its table */
+		if (kunwind_table_import(handle, descs[i].id, table, size) == 0
+		    || errno == EEXIST)
+			restored++;
+		free(table);
+	}
+	free(descs);
+	return nr < 0 ? nr : restored;
+}
+
+int kunwind_module_add(struct kunwind_handle *handle, struct load_info *linfo)
+{
+	return ioctl(handle->fd, KUNWIND_MODULE_ADD_IOCTL, linfo);
+}
+
+/* Remove the modules mapped in [start, start + len) */
+int kunwind_module_remove(struct kunwind_handle *handle, unsigned long start,
+		unsigned long len)
+{
+	struct kunwind_range range = {
+		.start = start,
+		.len = len,
+	};
+
+	return ioctl(handle->fd, KUNWIND_MODULE_REMOVE_IOCTL, &range);
+}
+
+static int has_module(struct proc_info *pinfo, struct load_info *linfo)
+{
+	for (unsigned int i = 0; i < pinfo->nr_load_segments; i++) {
+		if (pinfo->load_segments[i].eh_frame_hdr_ubuf
+		    == linfo->eh_frame_hdr_ubuf)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Make the modules of the kernel match the loaded objects, e.g. after a
+ * dlopen() or dlclose(). Only the objects that changed since the last
+ * call are added or removed, the first call only adds the objects
+ * loaded after the handle was opened.
+ */
+int kunwind_modules_update(struct kunwind_handle *handle)
+{
+	struct proc_info *old = handle->modules;
+	struct proc_info *pinfo;
+	struct load_info *linfo;
+	int ret;
+
+	pinfo = find_proc_info();
+	if (pinfo == NULL)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; old && i < old->nr_load_segments; i++) {
+		linfo = &old->load_segments[i];
+		if (has_module(pinfo, linfo))
+			continue;
+		ret = kunwind_module_remove(handle, linfo->eh_frame_hdr_ubuf, 1);
+		if (ret < 0 && errno != ENOENT)
+			goto err;
+	}
+	for (unsigned int i = 0; i < pinfo->nr_load_segments; i++) {
+		linfo = &pinfo->load_segments[i];
+		if (old && has_module(old, linfo))
+			continue;
+		ret = kunwind_module_add(handle, linfo);
+		if (ret < 0 && errno != EEXIST)
+			goto err;
+	}
+	free(old);
+	handle->modules = pinfo;
+	return 0;
+
+err:
+	free(pinfo);
+	return ret;
+}
+
+/* Let the kernel update the modules at each mmap() and munmap() */
+int kunwind_modules_track(struct kunwind_handle *handle)
+{
+	return ioctl(handle->fd, KUNWIND_MODULES_TRACK_IOCTL, NULL);
+}
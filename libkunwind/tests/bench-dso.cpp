@@ -0,0 +1,21 @@
+/*
+ * bench-dso.cpp
+ *
+ * Calls the next step of the chain, or fn once all the n steps are on
+ * the stack.
+ */
+
+#include "bench-dso.h"
+
+extern "C" __attribute__((noinline))
+void bench_dso_step(void *steps, int i, int n, void (*fn)(void *), void *arg)
+{
+	volatile int x = 0;
+
+	if (i < n)
+		((bench_step_fn *) steps)[i](steps, i + 1, n, fn, arg);
+	else
+		fn(arg);
+	/* no tail call, the frame stays on the stack */
+	x++;
+}
@@ -0,0 +1,20 @@
+/*
+ * bench-dso.h
+ *
+ * One step of a call chain crossing shared objects. test-benchmark loads
+ * copies of bench-dso.so under different names, so that each step of the
+ * chain is a frame of a different module.
+ */
+
+#ifndef LIBKUNWIND_TESTS_BENCH_DSO_H_
+#define LIBKUNWIND_TESTS_BENCH_DSO_H_
+
+#define BENCH_DSO_STEP "bench_dso_step"
+
+typedef void (*bench_step_fn)(void *steps, int i, int n,
+		void (*fn)(void *), void *arg);
+
+extern "C" void bench_dso_step(void *steps, int i, int n,
+		void (*fn)(void *), void *arg);
+
+#endif /* LIBKUNWIND_TESTS_BENCH_DSO_H_ */
@@ -3,11 +3,14 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/param.h>
@@ -25,6 +28,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <thread>
 
 static struct kunwind_handle *handle;
 
@@ -128,6 +132,270 @@ noinline void foo(void)
 	foo1();
 }
 
+static void count_record(const struct kunwind_record *rec, void *data)
+{
+	assert(rec->tid == (unsigned) getpid());
+	assert(rec->nr_entries > 0);
+	(*(int *) data)++;
+}
+
+noinline void test_ring(void)
+{
+	struct kunwind_ring *ring;
+	int count = 0;
+
+	assert(kunwind_ring_open(handle, 1, 0, &ring) == 0);
+	assert(kunwind_record(handle) == 0);
+	assert(kunwind_record(handle) == 0);
+	assert(kunwind_ring_consume(ring, count_record, &count) == 2);
+	assert(count == 2);
+	assert(kunwind_ring_consume(ring, count_record, &count) == 0);
+	assert(kunwind_ring_lost(ring) == 0);
+	kunwind_ring_close(ring);
+}
+
+void test_modules_update(void)
+{
+	/* the objects are already known, nothing is loaded twice */
+	assert(kunwind_modules_update(handle) == 0);
+	assert(kunwind_modules_update(handle) == 0);
+	assert(kunwind_module_remove(handle, 0, 1) < 0 && errno == ENOENT);
+}
+
+noinline void backtrace_at(struct kunwind_backtrace *bt)
+{
+	volatile int x = 0;
+	assert(kunwind_backtrace(handle, bt) == 0);
+}
+
+/* the spliced backtraces must be the same as the full one */
+noinline void test_incremental(void)
+{
+	struct kunwind_backtrace *bt[3];
+
+	for (int i = 0; i < 3; i++) {
+		bt[i] = kunwind_backtrace_new(DEPTH_MAX);
+		assert(bt[i] != NULL);
+		if (i == 1)
+			assert(kunwind_incremental_enable(handle) == 0);
+		backtrace_at(bt[i]);
+	}
+	for (int i = 1; i < 3; i++) {
+		assert(bt[i]->nr_entries == bt[0]->nr_entries);
+		assert(memcmp(bt[i]->entries, bt[0]->entries,
+			      bt[0]->nr_entries * sizeof(*bt[0]->entries)) == 0);
+	}
+	for (int i = 0; i < 3; i++)
+		kunwind_backtrace_free(bt[i]);
+}
+
+noinline void test_stack_ids(void)
+{
+	struct kunwind_backtrace *bt;
+	int ids[2];
+
+	assert(kunwind_stackmap_enable(handle, 16) == 0);
+	for (int i = 0; i < 2; i++)
+		ids[i] = kunwind_backtrace_id(handle);
+	assert(ids[0] > 0);
+	assert(ids[0] == ids[1]);
+
+	bt = kunwind_backtrace_new(DEPTH_MAX);
+	assert(bt != NULL);
+	assert(kunwind_stack_get(handle, ids[0], bt) == 0);
+	assert(bt->nr_entries > 0);
+	assert(kunwind_stack_get(handle, ids[0] + 1, bt) < 0);
+	kunwind_backtrace_free(bt);
+}
+
+noinline void test_status(void)
+{
+	struct kunwind_backtrace *bt;
+
+	bt = kunwind_backtrace_new(DEPTH_MAX);
+	assert(bt != NULL);
+	backtrace_at(bt);
+	assert(bt->status == KUNWIND_BT_COMPLETE);
+
+	/* a backtrace that doesn't fit is reported truncated */
+	bt->max_entries = 2;
+	backtrace_at(bt);
+	assert(bt->nr_entries == 2);
+	assert(bt->status == KUNWIND_BT_TRUNCATED);
+	kunwind_backtrace_free(bt);
+}
+
+/* the module ids and offsets resolve to pcs in the module table */
+noinline void test_modoff(void)
+{
+	struct kunwind_backtrace *bt;
+	int nr, found = 0;
+
+	nr = kunwind_module_table(handle, NULL, 0);
+	assert(nr > 0);
+	vector<struct kunwind_module_desc> descs(nr);
+	assert(kunwind_module_table(handle, descs.data(), nr) == nr);
+
+	bt = kunwind_backtrace_new(DEPTH_MAX);
+	assert(bt != NULL);
+	assert(kunwind_backtrace_modoff(handle, bt) == 0);
+	assert(bt->nr_entries > 0);
+	for (unsigned int i = 0; i < bt->nr_entries; i++) {
+		__u64 id = KUNWIND_MODOFF_ID(bt->entries[i]);
+		__u64 pc;
+
+		if (!id)
+			continue;
+		for (int j = 0; j < nr; j++) {
+			if (descs[j].id != id)
+				continue;
+			pc = descs[j].base + KUNWIND_MODOFF_OFFSET(bt->entries[i]);
+			assert(pc >= descs[j].start && pc < descs[j].end);
+			found++;
+		}
+	}
+	assert(found > 0);
+	kunwind_backtrace_free(bt);
+}
+
+/* the same backtrace without allocation, and the objects in a buffer */
+noinline void test_into(void)
+{
+	struct kunwind_backtrace *bt;
+	uint64_t buf[DEPTH_MAX];
+	char pbuf[PROC_INFO_SIZE(1)];
+	struct proc_info *pinfo = (struct proc_info *) pbuf;
+	int nr;
+
+	bt = kunwind_backtrace_new(DEPTH_MAX);
+	assert(bt != NULL);
+	backtrace_at(bt);
+	nr = kunwind_backtrace_into(handle, buf, DEPTH_MAX);
+	assert(nr > 0 && (unsigned) nr == bt->nr_entries);
+	assert(kunwind_backtrace_into(handle, buf, 2) == 2);
+	kunwind_backtrace_free(bt);
+
+	/* the program and libc don't fit in one entry */
+	nr = kunwind_proc_info_fill(pinfo, sizeof(pbuf));
+	assert(nr > 1);
+	assert(pinfo->nr_load_segments == 1);
+	assert(pinfo->size == sizeof(pbuf));
+}
+
+/* threads unwind through the shared handle and through their own */
+noinline void test_threads(void)
+{
+	vector<thread> threads;
+
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([i]() {
+			struct kunwind_handle *h = handle;
+			uint64_t buf[DEPTH_MAX];
+
+			if (i % 2) {
+				h = kunwind_thread_handle();
+				assert(h != NULL);
+				assert(kunwind_thread_handle() == h);
+			}
+			for (int j = 0; j < 100; j++)
+				assert(kunwind_backtrace_into(h, buf, DEPTH_MAX) > 0);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+}
+
+static unsigned int signal_status;
+static int signal_depth;
+
+static void signal_handler(int sig)
+{
+	struct kunwind_backtrace *bt;
+
+	bt = kunwind_backtrace_new(64);
+	assert(bt != NULL);
+	assert(kunwind_backtrace(handle, bt) == 0);
+	signal_status = bt->status;
+	signal_depth = bt->nr_entries;
+	kunwind_backtrace_free(bt);
+}
+
+/* the unwind goes through the signal frame, and the vdso is a module */
+noinline void test_signal(void)
+{
+	int nr, vdso = 0;
+
+	signal(SIGUSR1, signal_handler);
+	raise(SIGUSR1);
+	signal(SIGUSR1, SIG_DFL);
+	assert(signal_status == KUNWIND_BT_COMPLETE);
+	/* ioctl, the handler, the trampoline, raise, this and main */
+	assert(signal_depth >= 6);
+
+	nr = kunwind_module_table(handle, NULL, 0);
+	vector<struct kunwind_module_desc> descs(nr);
+	assert(kunwind_module_table(handle, descs.data(), nr) == nr);
+	for (auto &desc : descs)
+		vdso |= strcmp((const char *) desc.path, "[vdso]") == 0;
+	assert(vdso);
+}
+
+/* a table exports with a valid header, and bad imports are refused */
+void test_tables(void)
+{
+	struct kunwind_module_desc descs[64];
+	struct kunwind_table_header *hdr;
+	size_t size;
+	void *table;
+	int nr;
+
+	nr = kunwind_module_table(handle, descs, 64);
+	assert(nr > 0);
+	assert(kunwind_table_export(handle, descs[0].id, &table, &size) == 0);
+	hdr = (struct kunwind_table_header *) table;
+	assert(size >= sizeof(*hdr));
+	assert(hdr->magic == KUNWIND_TABLE_MAGIC);
+	assert(hdr->version == KUNWIND_TABLE_VERSION);
+	assert(size == sizeof(*hdr) + hdr->nr_rows * sizeof(kunwind_table_row)
+	       + hdr->nr_nofp * sizeof(kunwind_table_range));
+
+	/* the module has its table already, a bad one is still rejected */
+	assert(kunwind_table_import(handle, descs[0].id, table, size) < 0);
+	assert(errno == EEXIST || errno == EPERM || errno == ESTALE);
+	hdr->magic = ~hdr->magic;
+	assert(kunwind_table_import(handle, descs[0].id, table, size) < 0);
+	assert(errno == EINVAL || errno == EPERM);
+	free(table);
+}
+
+/* identical records are counted once per stack, in folded format */
+noinline void test_profile(void)
+{
+	struct kunwind_stack_count counts[16];
+	unsigned long long lost = 0;
+	char *folded;
+	size_t len;
+	FILE *out;
+
+	assert(kunwind_profile_enable(handle, 16) == 0);
+	for (int i = 0; i < 3; i++)
+		assert(kunwind_record(handle) == 0);
+	assert(kunwind_profile_drain(handle, counts, 16, &lost) == 1);
+	assert(counts[0].count == 3);
+	assert(lost == 0);
+	assert(kunwind_profile_drain(handle, counts, 16, &lost) == 0);
+
+	for (int i = 0; i < 2; i++)
+		assert(kunwind_record(handle) == 0);
+	out = open_memstream(&folded, &len);
+	assert(out != NULL);
+	assert(kunwind_profile_folded(handle, out) == 1);
+	fclose(out);
+	assert(strncmp(folded, "0x", 2) == 0);
+	assert(len > 3 && strcmp(folded + len - 3, " 2\n") == 0);
+	free(folded);
+}
+
 int main(int argc, char **argv)
 {
 	/*
@@ -143,6 +411,18 @@ int main(int argc, char **argv)
 	save_maps();
 	assert(kunwind_open(&handle) == 0);
 	foo();
+	test_ring();
+	test_stack_ids();
+	test_incremental();
+	test_modules_update();
+	test_modoff();
+	test_status();
+	test_into();
+	test_threads();
+	test_signal();
+	test_tables();
+	/* last, the records no longer go to the ring */
+	test_profile();
 	kunwind_close(handle);
 	return 0;
 }
@@ -2,22 +2,181 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <sstream>
+#include <thread>
 
+#include <alloca.h>
+#include <dlfcn.h>
 #include <execinfo.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <libkunwind.h>
 
+#define UNW_LOCAL_ONLY
+#include <libunwind.h>
+
+#include "bench-dso.h"
+
 #define DEPTH_MAX 128
 #define noinline __attribute((noinline))
 
+/*
+ * Suites:
+ *   depth    latency at power-of-two depths
+ *   cold     first unwind after opening the handle, then warm
+ *   threads  1 to N threads sharing the handle, or each with its own
+ *   dso      call chain crossing many dlopen-ed objects
+ *   shapes   frame pointers, dynamic stack, realigned stack, signal frame
+ * Each result is one line, a JSON object per line with -j.
+ */
+static const char *usage =
+	"usage: test-benchmark [-r repeat] [-d depth] [-m max_depth]\n"
+	"       [-t max_threads] [-c cold_cycles] [-n nr_dsos] [-l dso_path]\n"
+	"       [-s depth,cold,threads,dso,shapes] [-j]\n";
+
 static struct kunwind_handle *handle;
-static struct kunwind_backtrace *bt;
+/* kunwind_thread_handle() of the threads suite, else handle */
+static thread_local struct kunwind_handle *cur_handle;
+static thread_local struct kunwind_backtrace *bt;
 
 using namespace std;
 
-noinline void foo(int rec, function<void ()> fn)
+enum method {
+	KUNWIND,
+	LIBUNWIND,
+	GLIBC,
+	NR_METHODS,
+};
+
+static const char *method_names[NR_METHODS] = {
+	"kunwind",
+	"libunwind",
+	"glibc",
+};
+
+struct result {
+	string suite;
+	string param;
+	enum method method;
+	vector<uint64_t> samples;	/* ns */
+	unsigned int depth = 0;		/* of the last backtrace */
+	int status = -1;		/* of the last kunwind backtrace */
+	double rate = 0;		/* backtraces per second, all threads */
+};
+
+static int repeat = 1000;
+static int depth = 16;
+static int depth_max = DEPTH_MAX;
+static int max_threads = 0;
+static int cold_cycles = 20;
+static int nr_dsos = 200;
+static string dso_path = ".libs/bench-dso.so";
+static bool json;
+
+static inline uint64_t now_ns(void)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline struct kunwind_backtrace *thread_bt(void)
+{
+	if (!bt) {
+		bt = kunwind_backtrace_new(DEPTH_MAX);
+		assert(bt);
+	}
+	return bt;
+}
+
+/* Returns the depth found, -1 on error */
+noinline int unwind_with(enum method m, int *status)
+{
+	void *buf[DEPTH_MAX];
+	struct kunwind_backtrace *kbt;
+
+	switch (m) {
+	case KUNWIND:
+		kbt = thread_bt();
+		if (kunwind_backtrace(cur_handle ? cur_handle : handle, kbt) < 0)
+			return -1;
+		if (status)
+			*status = kbt->status;
+		return kbt->nr_entries;
+	case LIBUNWIND:
+		return unw_backtrace(buf, DEPTH_MAX);
+	case GLIBC:
+		return backtrace(buf, DEPTH_MAX);
+	default:
+		return -1;
+	}
+}
+
+/* Time one backtrace in res */
+static inline void sample(struct result &res)
+{
+	uint64_t t1 = now_ns();
+	int nr = unwind_with(res.method, &res.status);
+	uint64_t t2 = now_ns();
+
+	assert(nr > 0);
+	res.samples.push_back(t2 - t1);
+	res.depth = nr;
+}
+
+static uint64_t percentile(const vector<uint64_t> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[min(sorted.size() - 1,
+			  (size_t) (p / 100 * sorted.size()))];
+}
+
+static void report(struct result &res)
+{
+	vector<uint64_t> sorted(res.samples);
+	double mean = 0;
+
+	sort(sorted.begin(), sorted.end());
+	for (auto s : sorted)
+		mean += s;
+	if (!sorted.empty())
+		mean /= sorted.size();
+
+	if (json) {
+		printf("{\"suite\":\"%s\",\"param\":\"%s\",\"method\":\"%s\","
+		       "\"n\":%zu,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+		       "\"mean_ns\":%.0f,\"depth\":%u,\"status\":%d,"
+		       "\"rate\":%.0f}\n",
+		       res.suite.c_str(), res.param.c_str(),
+		       method_names[res.method], sorted.size(),
+		       (unsigned long long) percentile(sorted, 50),
+		       (unsigned long long) percentile(sorted, 99),
+		       mean, res.depth, res.status, res.rate);
+	} else {
+		printf("%-8s %-14s %-10s n=%-7zu p50=%-8llu p99=%-8llu "
+		       "mean=%-8.0f depth=%-4u status=%-2d",
+		       res.suite.c_str(), res.param.c_str(),
+		       method_names[res.method], sorted.size(),
+		       (unsigned long long) percentile(sorted, 50),
+		       (unsigned long long) percentile(sorted, 99),
+		       mean, res.depth, res.status);
+		if (res.rate)
+			printf(" rate=%.0f/s", res.rate);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+noinline void foo(int rec, const function<void ()> &fn)
 {
 	volatile int x = 0;
 	if (rec > 0) {
@@ -25,60 +184,318 @@ noinline void foo(int rec, function<void ()> fn)
 	} else {
 		fn();
 	}
+	x++;
 }
 
-int main(int argc, char **argv)
+static void run_at_depth(const string &suite, const string &param, int d,
+		enum method m, int n)
 {
-	int repeat = 1000;
-	int depth_min = 1;
-	int depth_max = DEPTH_MAX;
-	int verbose = 0;
+	struct result res;
 
-	/* positional arguments overloads the defaults */
+	res.suite = suite;
+	res.param = param;
+	res.method = m;
+	res.samples.reserve(n);
+	foo(d, [&]() {
+		for (int j = 0; j < n; j++)
+			sample(res);
+	});
+	report(res);
+}
 
-	if (argc > 1)
-		repeat = atoi(argv[1]);
-	if (argc > 2)
-		depth_min = atoi(argv[2]);
-	if (argc > 3)
-		depth_max = min(atoi(argv[3]), DEPTH_MAX);
+static void suite_depth(void)
+{
+	for (int i = 1; i <= depth_max; i *= 2)
+		for (int m = 0; m < NR_METHODS; m++)
+			run_at_depth("depth", to_string(i), i,
+				     (enum method) m, repeat);
+}
 
-	printf("repeat=%d depth_min=%d depth_max=%d\n", repeat, depth_min, depth_max);
+/*
+ * Closing the last handle of the process releases its modules, the
+ * first unwind after opening a new one loads them again.
+ */
+static void suite_cold(void)
+{
+	struct result cold, warm;
 
-	assert(kunwind_open(&handle) == 0);
-	bt = kunwind_backtrace_new(depth_max);
-	assert(bt);
-
-	for (int i = depth_min; i <= depth_max; i *= 2) {
-
-		/*
-		 * Check that the depth matches
-		 */
-		foo(i, [&](){
-			void *buf[depth_max + 1];
-			int depth = backtrace(buf, depth_max);
-			kunwind_backtrace(handle, bt);
-
-			int diff = depth - bt->nr_entries;
-			if (diff < 0)
-				diff *= -1;
-			if (verbose)
-				printf("%-5d %-5d %-5d %-5d\n", i, depth, bt->nr_entries, diff);
-			assert(diff <= 1);
+	cold.suite = warm.suite = "cold";
+	cold.param = "first";
+	warm.param = "warm";
+	cold.method = warm.method = KUNWIND;
+	for (int i = 0; i < cold_cycles; i++) {
+		kunwind_close(handle);
+		assert(kunwind_open(&handle) == 0);
+		foo(depth, [&]() {
+			sample(cold);
+			for (int j = 0; j < repeat / cold_cycles; j++)
+				sample(warm);
 		});
+	}
+	report(cold);
+	report(warm);
+}
 
-		auto t1 = chrono::system_clock::now();
-		for (int j = 0; j < repeat; j++) {
-			foo(i, [&]() {
-				assert(kunwind_backtrace(handle, bt) == 0);
-				assert(bt->nr_entries >= i);
+/* With local, each thread unwinds with its own handle */
+static void run_threads(int nr, enum method m, bool local)
+{
+	vector<struct result> results(nr);
+	vector<thread> threads;
+	atomic<int> ready(0);
+	atomic<bool> go(false);
+	uint64_t t1, t2;
+
+	for (int i = 0; i < nr; i++) {
+		results[i].method = m;
+		results[i].samples.reserve(repeat);
+		threads.emplace_back([&, i]() {
+			if (local) {
+				cur_handle = kunwind_thread_handle();
+				assert(cur_handle);
+			}
+			ready++;
+			while (!go)
+				;
+			foo(depth, [&]() {
+				for (int j = 0; j < repeat; j++)
+					sample(results[i]);
 			});
+			kunwind_backtrace_free(bt);
+			bt = NULL;
+		});
+	}
+	while (ready != nr)
+		;
+	t1 = now_ns();
+	go = true;
+	for (auto &t : threads)
+		t.join();
+	t2 = now_ns();
+
+	struct result all = results[0];
+	all.suite = "threads";
+	all.param = to_string(nr) + (local ? "/local" : "/shared");
+	for (int i = 1; i < nr; i++)
+		all.samples.insert(all.samples.end(),
+				   results[i].samples.begin(),
+				   results[i].samples.end());
+	all.rate = all.samples.size() * 1E9 / (t2 - t1);
+	report(all);
+}
+
+static void suite_threads(void)
+{
+	int nr_max = max_threads ? max_threads : thread::hardware_concurrency();
+
+	for (int nr = 1; nr <= max(nr_max, 1); nr *= 2) {
+		for (int m = 0; m < NR_METHODS; m++)
+			run_threads(nr, (enum method) m, false);
+		run_threads(nr, KUNWIND, true);
+	}
+}
+
+static void sample_cb(void *arg)
+{
+	sample(*(struct result *) arg);
+}
+
+/*
+ * Each copy of the object is a distinct file, so a distinct module for
+ * the kernel. The chain of calls goes through all of them.
+ */
+static void suite_dso(void)
+{
+	char dir[] = "/tmp/kunwind-bench-XXXXXX";
+	vector<bench_step_fn> steps;
+	vector<void *> libs;
+	vector<string> paths;
+	string data;
+
+	FILE *src = fopen(dso_path.c_str(), "r");
+	if (!src || !mkdtemp(dir)) {
+		fprintf(stderr, "dso: can't read %s\n", dso_path.c_str());
+		if (src)
+			fclose(src);
+		return;
+	}
+	char chunk[4096];
+	size_t len;
+	while ((len = fread(chunk, 1, sizeof(chunk), src)) > 0)
+		data.append(chunk, len);
+	fclose(src);
+
+	for (int i = 0; i < nr_dsos; i++) {
+		string path = string(dir) + "/bench-dso-" + to_string(i) + ".so";
+		FILE *dst = fopen(path.c_str(), "w");
+
+		assert(dst);
+		assert(fwrite(data.data(), 1, data.size(), dst) == data.size());
+		fclose(dst);
+		paths.push_back(path);
+
+		void *lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		assert(lib);
+		libs.push_back(lib);
+		steps.push_back((bench_step_fn) dlsym(lib, BENCH_DSO_STEP));
+		assert(steps.back());
+	}
+	/* the objects were loaded after the handle was opened */
+	assert(kunwind_modules_update(handle) == 0);
+
+	int n = min(nr_dsos, DEPTH_MAX - 8);
+	for (int m = 0; m < NR_METHODS; m++) {
+		struct result res;
+
+		res.suite = "dso";
+		res.param = to_string(nr_dsos) + "/" + to_string(n);
+		res.method = (enum method) m;
+		for (int j = 0; j < repeat; j++)
+			steps[0](steps.data(), 1, n, sample_cb, &res);
+		report(res);
+	}
+
+	for (size_t i = 0; i < libs.size(); i++) {
+		dlclose(libs[i]);
+		unlink(paths[i].c_str());
+	}
+	rmdir(dir);
+	assert(kunwind_modules_update(handle) == 0);
+}
+
+__attribute__((optimize("no-omit-frame-pointer"))) noinline
+void shape_fp(int rec, const function<void ()> &fn)
+{
+	volatile int x = 0;
+	if (rec > 0)
+		shape_fp(rec - 1, fn);
+	else
+		fn();
+	x++;
+}
+
+/* the cfa is found from rbp, rsp moves with the array */
+noinline void shape_alloca(int rec, const function<void ()> &fn)
+{
+	volatile char *p = (volatile char *) alloca(16 + rec);
+	p[0] = 0;
+	if (rec > 0)
+		shape_alloca(rec - 1, fn);
+	else
+		fn();
+	p[0]++;
+}
+
+/* stack realignment, the cfa is a DWARF expression */
+noinline void shape_realign(int rec, const function<void ()> &fn)
+{
+	alignas(64) volatile char buf[64];
+	buf[0] = 0;
+	if (rec > 0)
+		shape_realign(rec - 1, fn);
+	else
+		fn();
+	buf[0]++;
+}
+
+static struct result *signal_res;
+static int signal_n;
+
+static void signal_handler(int sig)
+{
+	for (int j = 0; j < signal_n; j++)
+		sample(*signal_res);
+}
+
+static void run_shape(const char *name,
+		void (*shape)(int, const function<void ()> &))
+{
+	for (int m = 0; m < NR_METHODS; m++) {
+		struct result res;
+
+		res.suite = "shapes";
+		res.param = name;
+		res.method = (enum method) m;
+		res.samples.reserve(repeat);
+		shape(depth, [&]() {
+			for (int j = 0; j < repeat; j++)
+				sample(res);
+		});
+		report(res);
+	}
+}
+
+static void suite_shapes(void)
+{
+	run_shape("standard", foo);
+	run_shape("fp", shape_fp);
+	run_shape("alloca", shape_alloca);
+	run_shape("realign", shape_realign);
+
+	/* the outer frames are behind the sigreturn trampoline */
+	signal(SIGUSR1, signal_handler);
+	for (int m = 0; m < NR_METHODS; m++) {
+		struct result res;
+
+		res.suite = "shapes";
+		res.param = "signal";
+		res.method = (enum method) m;
+		signal_res = &res;
+		signal_n = repeat;
+		foo(depth, []() { raise(SIGUSR1); });
+		report(res);
+	}
+	signal(SIGUSR1, SIG_DFL);
+}
+
+int main(int argc, char **argv)
+{
+	string suites = "depth,cold,threads,dso,shapes";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:d:m:t:c:n:l:s:j")) != -1) {
+		switch (opt) {
+		case 'r': repeat = atoi(optarg); break;
+		case 'd': depth = min(atoi(optarg), DEPTH_MAX - 8); break;
+		case 'm': depth_max = min(atoi(optarg), DEPTH_MAX - 8); break;
+		case 't': max_threads = atoi(optarg); break;
+		case 'c': cold_cycles = max(atoi(optarg), 1); break;
+		case 'n': nr_dsos = max(atoi(optarg), 1); break;
+		case 'l': dso_path = optarg; break;
+		case 's': suites = optarg; break;
+		case 'j': json = true; break;
+		default:
+			fprintf(stderr, "%s", usage);
+			return 1;
 		}
-		auto t2 = chrono::system_clock::now();
-		chrono::duration<double> diff = t2 - t1;
-		auto avg = diff.count() / repeat;
-		auto unit = avg / i;
-		printf("%-5d %6.3f us (%6.3f us)\n", i, avg * 1E6, unit * 1E6);
+	}
+	if (repeat <= 0) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	if (!json)
+		printf("repeat=%d depth=%d depth_max=%d suites=%s\n",
+		       repeat, depth, depth_max, suites.c_str());
+
+	assert(kunwind_open(&handle) == 0);
+	/* the first glibc backtrace() loads libgcc_s */
+	unwind_with(GLIBC, NULL);
+
+	stringstream ss(suites);
+	string suite;
+	while (getline(ss, suite, ',')) {
+		if (suite == "depth")
+			suite_depth();
+		else if (suite == "cold")
+			suite_cold();
+		else if (suite == "threads")
+			suite_threads();
+		else if (suite == "dso")
+			suite_dso();
+		else if (suite == "shapes")
+			suite_shapes();
+		else
+			fprintf(stderr, "unknown suite %s\n", suite.c_str());
 	}
 
 	kunwind_backtrace_free(bt);
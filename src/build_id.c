@@ -0,0 +1,133 @@
+#include <linux/elf.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "build_id.h"
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+/* Bounds on what is read from the file, real headers are much smaller */
+#define BUILD_ID_MAX_PHNUM 64
+#define BUILD_ID_MAX_NOTES 4096
+
+static int read_exact(struct file *file, loff_t offset, void *buf,
+		      unsigned long size)
+{
+	int ret = kernel_read(file, offset, buf, size);
+
+	if (ret < 0)
+		return ret;
+	return ret == size ? 0 : -EIO;
+}
+
+/* Search the notes of a PT_NOTE segment for the GNU build id */
+static int notes_build_id(const u8 *notes, unsigned long size,
+			  u8 *build_id, unsigned int max)
+{
+	const Elf64_Nhdr *nhdr;	/* same layout for both classes */
+	unsigned long off = 0, namesz, descsz;
+
+	while (size - off >= sizeof(*nhdr)) {
+		nhdr = (const Elf64_Nhdr *) (notes + off);
+		namesz = ALIGN(nhdr->n_namesz, 4);
+		descsz = ALIGN(nhdr->n_descsz, 4);
+		off += sizeof(*nhdr);
+		if (namesz > size - off || descsz > size - off - namesz)
+			break;
+		if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+		    && !memcmp(notes + off, "GNU", 4)) {
+			if (!nhdr->n_descsz || nhdr->n_descsz > max)
+				return -EINVAL;
+			memcpy(build_id, notes + off + namesz, nhdr->n_descsz);
+			return nhdr->n_descsz;
+		}
+		off += namesz + descsz;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Read the GNU build id of an ELF file of either class in build_id.
+ * Returns its length, or -ENOENT if the file has none.
+ */
+int file_build_id(struct file *file, u8 *build_id, unsigned int size)
+{
+	union {
+		Elf32_Ehdr e32;
+		Elf64_Ehdr e64;
+	} ehdr;
+	unsigned long phoff, phentsize, phnum, offset, filesz;
+	void *phdrs;
+	u8 *notes = NULL;
+	unsigned int i;
+	u32 type;
+	int ret;
+
+	ret = read_exact(file, 0, &ehdr, sizeof(ehdr));
+	if (ret)
+		return ret;
+	if (memcmp(ehdr.e64.e_ident, ELFMAG, SELFMAG))
+		return -ENOEXEC;
+
+	if (ehdr.e64.e_ident[EI_CLASS] == ELFCLASS64) {
+		phoff = ehdr.e64.e_phoff;
+		phentsize = sizeof(Elf64_Phdr);
+		phnum = ehdr.e64.e_phnum;
+	} else if (ehdr.e64.e_ident[EI_CLASS] == ELFCLASS32) {
+		phoff = ehdr.e32.e_phoff;
+		phentsize = sizeof(Elf32_Phdr);
+		phnum = ehdr.e32.e_phnum;
+	} else {
+		return -ENOEXEC;
+	}
+	if (!phnum || phnum > BUILD_ID_MAX_PHNUM)
+		return -ENOEXEC;
+
+	phdrs = kmalloc(phnum * phentsize, GFP_KERNEL);
+	if (!phdrs)
+		return -ENOMEM;
+	ret = read_exact(file, phoff, phdrs, phnum * phentsize);
+	if (ret)
+		goto out;
+
+	ret = -ENOENT;
+	for (i = 0; i < phnum; i++) {
+		if (phentsize == sizeof(Elf64_Phdr)) {
+			const Elf64_Phdr *phdr = (const Elf64_Phdr *) phdrs + i;
+
+			type = phdr->p_type;
+			offset = phdr->p_offset;
+			filesz = phdr->p_filesz;
+		} else {
+			const Elf32_Phdr *phdr = (const Elf32_Phdr *) phdrs + i;
+
+			type = phdr->p_type;
+			offset = phdr->p_offset;
+			filesz = phdr->p_filesz;
+		}
+		if (type != PT_NOTE || !filesz || filesz > BUILD_ID_MAX_NOTES)
+			continue;
+
+		kfree(notes);
+		notes = kmalloc(filesz, GFP_KERNEL);
+		if (!notes) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = read_exact(file, offset, notes, filesz);
+		if (ret)
+			break;
+		ret = notes_build_id(notes, filesz, build_id, size);
+		if (ret != -ENOENT)
+			break;
+	}
+	kfree(notes);
+out:
+	kfree(phdrs);
+	return ret;
+}
@@ -0,0 +1,11 @@
+#ifndef _BUILD_ID_H_
+#define _BUILD_ID_H_
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#include <kunwind.h>
+
+int file_build_id(struct file *file, u8 *build_id, unsigned int size);
+
+#endif // _BUILD_ID_H_
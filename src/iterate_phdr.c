@@ -2,8 +2,10 @@
 #include "vma_file_path.h"
 
 #include <linux/elf.h>
+#include <linux/mm.h>
 #include <linux/vmalloc.h>
 
+/* The vmas are walked, and cb called, with mmap_sem held for read */
 int iterate_phdr(int (*cb) (struct phdr_info *info,
 			    struct task_struct *task,
 			    void *data),
@@ -16,20 +18,24 @@ int iterate_phdr(int (*cb) (struct phdr_info *info,
 	int res = 0, err = 0;
 	struct page *page; // FIXME Is one page enough for all phdrs?
 	Elf64_Ehdr *ehdr;
-	bool first = true;
+	unsigned long phoff, phentsize;
+	bool first = true, vdso;
 
 	if (!mm) return -EINVAL;
 
+	down_read(&mm->mmap_sem);
 	for (vma = mm->mmap; vma; vma = vma->vm_next) {
-		if (vma->vm_pgoff)
+		// The vDSO is anonymous, vm_pgoff is its address
+		vdso = vma_is_vdso(vma);
+		if (vma->vm_pgoff && !vdso)
 			// Only the first page contains the elf
 			// headers, normally.
 			continue;
 
-		err = __get_user_pages_unlocked(
-			task, task->mm, vma->vm_start,
-			1, 0, 0, &page, FOLL_TOUCH);
-		if (err < 0)
+		err = get_user_pages_remote(
+			task, mm, vma->vm_start,
+			1, 0, 0, &page, NULL);
+		if (err < 1)
 			continue;
 
 		ehdr = vmap(&page, 1, vma->vm_flags, vma->vm_page_prot);
@@ -43,10 +49,27 @@ int iterate_phdr(int (*cb) (struct phdr_info *info,
 		err |= (ehdr->e_ident[3] != ELFMAG3);
 		if (err) goto UNMAP;
 
-		// Set addresses
-		pi.addr = first ? 0 : vma->vm_start;
-		pi.phdr = (void *) ehdr + ehdr->e_phoff;
-		pi.phnum = ehdr->e_phnum;
+		// Set addresses, compat tasks map Elf32 objects
+		pi.addr = first && !vdso ? 0 : vma->vm_start;
+		pi.elfclass = ehdr->e_ident[EI_CLASS];
+		if (pi.elfclass == ELFCLASS64) {
+			phoff = ehdr->e_phoff;
+			pi.phnum = ehdr->e_phnum;
+			phentsize = sizeof(Elf64_Phdr);
+		} else if (pi.elfclass == ELFCLASS32) {
+			Elf32_Ehdr *ehdr32 = (Elf32_Ehdr *) ehdr;
+
+			phoff = ehdr32->e_phoff;
+			pi.phnum = ehdr32->e_phnum;
+			phentsize = sizeof(Elf32_Phdr);
+		} else {
+			goto UNMAP;
+		}
+		// Only the mapped page can be read
+		if (phoff > PAGE_SIZE
+		    || pi.phnum > (PAGE_SIZE - phoff) / phentsize)
+			goto UNMAP;
+		pi.phdr = (void *) ehdr + phoff;
 
 		// Find path
 		pi.name = vma_file_path(vma, buf, NAME_BUFLEN);
@@ -64,5 +87,6 @@ int iterate_phdr(int (*cb) (struct phdr_info *info,
 
 		first = false;
 	}
+	up_read(&mm->mmap_sem);
 	return res;
 }
@@ -11,6 +11,7 @@ struct phdr_info {
 	void *phdr; /* Pointer to array of ELF program headers for
 		       this object */
 	unsigned int phnum; /* # of items in phdr */
+	unsigned char elfclass; /* ELFCLASS32 or ELFCLASS64 phdrs */
 };
 
 int iterate_phdr(int (*cb) (struct phdr_info *info,
@@ -1,135 +1,354 @@
+#include <linux/capability.h>
+#include <linux/compat.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/kallsyms.h>
 #include <linux/kernel.h>
+#include <linux/mman.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
+#include <linux/preempt.h>
 #include <linux/printk.h>
 #include <linux/proc_fs.h>
+#include <linux/rhashtable.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
-#include <linux/hashtable.h>
 #include <linux/stacktrace.h>
+#include <linux/string.h>
+#include <linux/task_work.h>
+#include <linux/tracepoint.h>
+#include <asm/syscall.h>
+#ifdef CONFIG_IA32_EMULATION
+#include <asm/ia32_unistd.h>
+#endif
 
 #include <proc_info.h>
 #include <kunwind.h>
 
 #include "debug.h"
 #include "modules.h"
+#include "ring.h"
+#include "stackmap.h"
+#include "stats.h"
 
-static const u32 entries_limit = 128;
 #define PROC_FILENAME "kunwind_debug"
 
-DEFINE_HASHTABLE(kunw_map, 3);
-
-struct kunw_map_key {
-	pid_t tgid;
-} __attribute__((__packed__));
-
+/*
+ * Registered processes, by address space. All the threads of a process
+ * share its modules, the last file closed releases them. The lookups
+ * only need rcu_read_lock() and take constant time, the table grows
+ * with the number of processes.
+ */
 struct kunw_map_val {
-	pid_t tgid;
+	struct mm_struct *mm;		/* pinned while registered */
 	struct kunwind_proc_modules *mods;
-	struct hlist_node hlist;
-	struct rcu_head rcu;
+	unsigned int users;		/* references, under kunw_map_lock */
+	struct rhash_head node;
 };
 
-static
-struct kunw_map_val* kunwind_process_find(struct kunw_map_key *key, u32 hash)
-{
-        struct kunw_map_val *val;
+static const struct rhashtable_params kunw_map_params = {
+	.key_len = sizeof(struct mm_struct *),
+	.key_offset = offsetof(struct kunw_map_val, mm),
+	.head_offset = offsetof(struct kunw_map_val, node),
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable kunw_map;
+/* serializes the updates of kunw_map and of the users counts */
+static DEFINE_MUTEX(kunw_map_lock);
 
-        hash_for_each_possible_rcu(kunw_map, val, hlist, hash) {
-                if (key->tgid == val->tgid) {
-                        return val;
-                }
-        }
-        return NULL;
+/*
+ * A thread of the process that kunwind flagged with TIF_SYSCALL_AUDIT.
+ * The pid doesn't pin the task, which may have exited since.
+ */
+struct kunwind_thread {
+	struct list_head list;		/* in mods->threads */
+	struct pid *pid;
+};
+
+/* Must be called under rcu_read_lock() or kunw_map_lock */
+static struct kunw_map_val *kunwind_process_find(struct mm_struct *mm)
+{
+	return rhashtable_lookup_fast(&kunw_map, &mm, kunw_map_params);
 }
 
-void kunwind_process_register(struct kunwind_proc_modules *mods, pid_t tgid)
+static struct kunwind_proc_modules *kunwind_process_register(
+		struct mm_struct *mm)
 {
-	u32 hash;
-	struct kunw_map_key key;
+	struct kunwind_proc_modules *mods;
 	struct kunw_map_val *val;
+	int err;
 
-	key.tgid = tgid;
-	hash = jhash(&key, sizeof(key), 0);
-
-	/*
-	 * FIXME: two threads could theoretically register at the same time.
-	 * Registration should be protected with a lock.
-	 */
-	rcu_read_lock();
-	val = kunwind_process_find(&key, hash);
+	mutex_lock(&kunw_map_lock);
+	val = kunwind_process_find(mm);
 	if (val) {
-		rcu_read_unlock();
-		return;
+		val->users++;
+		mods = val->mods;
+		goto out;
 	}
-	rcu_read_unlock();
-	val = kzalloc(sizeof(struct kunw_map_val), GFP_KERNEL);
-	val->tgid = tgid;
+
+	err = -ENOMEM;
+	val = kzalloc(sizeof(*val), GFP_KERNEL);
+	mods = kmalloc(sizeof(*mods), GFP_KERNEL);
+	if (!val || !mods)
+		goto err;
+
+	err = init_proc_unwind_info(mods, _stp_is_compat_task());
+	if (err)
+		goto err;
+	mods->mm = mm;
+	val->mm = mm;
 	val->mods = mods;
-	hash_add_rcu(kunw_map, &val->hlist, hash);
+	val->users = 1;
+	err = rhashtable_insert_fast(&kunw_map, &val->node, kunw_map_params);
+	if (err)
+		goto err;
+	/* the mm_struct can't be reused for another process */
+	atomic_inc(&mm->mm_count);
+out:
+	mutex_unlock(&kunw_map_lock);
+	return mods;
+
+err:
+	mutex_unlock(&kunw_map_lock);
+	kfree(mods);
+	kfree(val);
+	return ERR_PTR(err);
+}
+
+static void kunwind_syscalls_put(void);
+static void kunwind_mmap_track_put(void);
+
+/* Give the fast syscall path back to the threads kunwind flagged */
+static void kunwind_threads_release(struct kunwind_proc_modules *mods)
+{
+	struct kunwind_thread *thread, *tmp;
+	struct task_struct *task;
+
+	list_for_each_entry_safe(thread, tmp, &mods->threads, list) {
+		rcu_read_lock();
+		task = pid_task(thread->pid, PIDTYPE_PID);
+		if (task)
+			clear_tsk_thread_flag(task, TIF_SYSCALL_AUDIT);
+		rcu_read_unlock();
+		put_pid(thread->pid);
+		kfree(thread);
+	}
+	INIT_LIST_HEAD(&mods->threads);
 }
 
-void kunwind_process_unregister(pid_t tgid)
+/*
+ * Drop a reference taken by kunwind_process_register() or
+ * kunwind_process_get(). Returns 1 if the modules were released.
+ */
+static int kunwind_process_unregister(struct kunwind_proc_modules *mods)
 {
-	u32 hash;
-	struct kunw_map_key key;
+	struct mm_struct *mm = mods->mm;
 	struct kunw_map_val *val;
+	int syscalls, track_mmap;
+
+	mutex_lock(&kunw_map_lock);
+	val = kunwind_process_find(mm);
+	if (WARN_ON(!val) || --val->users) {
+		mutex_unlock(&kunw_map_lock);
+		return 0;
+	}
+	rhashtable_remove_fast(&kunw_map, &val->node, kunw_map_params);
+	mutex_unlock(&kunw_map_lock);
 
-	key.tgid = tgid;
-	hash = jhash(&key, sizeof(key), 0);
+	synchronize_rcu();
+	/* read before the release, which frees the ring */
+	syscalls = mods->ring && (mods->ring->flags & KUNWIND_RING_SYSCALLS);
+	track_mmap = mods->track_mmap;
+	kunwind_threads_release(mods);
+	release_unwind_info(mods);
+	mmdrop(mm);
+	kfree(val);
+	if (syscalls)
+		kunwind_syscalls_put();
+	if (track_mmap)
+		kunwind_mmap_track_put();
+	return 1;
+}
 
-	rcu_read_lock();
-	val = kunwind_process_find(&key, hash);
+/* Reference the modules of mm if it is registered */
+static struct kunwind_proc_modules *kunwind_process_get(struct mm_struct *mm)
+{
+	struct kunwind_proc_modules *mods = NULL;
+	struct kunw_map_val *val;
+
+	mutex_lock(&kunw_map_lock);
+	val = kunwind_process_find(mm);
 	if (val) {
-		hash_del_rcu(&val->hlist);
-		synchronize_rcu();
-		release_unwind_info(val->mods);
+		val->users++;
+		mods = val->mods;
 	}
-	rcu_read_unlock();
+	mutex_unlock(&kunw_map_lock);
+	return mods;
 }
 
+/*
+ * The unwinds of current need all its user registers in pt_regs, which
+ * only the slow syscall path saves. The flag is per thread: each thread
+ * registers at its first unwind, whose registers were not all saved.
+ * Threads that audit already flagged are left alone, the others are
+ * recorded so that the last release clears the flag again. Returns 1 if
+ * current was not registered yet.
+ */
+static int kunwind_thread_register(struct kunwind_proc_modules *mods)
+{
+	struct kunwind_thread *thread;
+
+	if (test_thread_flag(TIF_SYSCALL_AUDIT))
+		return 0;
+	thread = kmalloc(sizeof(*thread), GFP_KERNEL);
+	if (!thread)
+		return -ENOMEM;
+	thread->pid = get_task_pid(current, PIDTYPE_PID);
+	mutex_lock(&mods->lock);
+	list_add(&thread->list, &mods->threads);
+	mutex_unlock(&mods->lock);
+	set_thread_flag(TIF_SYSCALL_AUDIT);
+	return 1;
+}
 
 static int kunwind_debug_open(struct inode *inode, struct file *file)
 {
-	int ret;
-	int compat;
-	int hash;
 	struct kunwind_proc_modules *mods;
-	struct kunw_map_key key;
+	int err;
 
-	key.tgid = current->pid;
-	hash = jhash(&key, sizeof(key), 0);
-	if (kunwind_process_find(&key, hash)) {
-		return -EBUSY;
+	if (!current->mm)
+		return -EINVAL;
+
+	mods = kunwind_process_register(current->mm);
+	if (IS_ERR(mods))
+		return PTR_ERR(mods);
+	unw_cache_test();
+	err = kunwind_thread_register(mods);
+	if (err < 0) {
+		kunwind_process_unregister(mods);
+		return err;
 	}
 
-	mods = kmalloc(sizeof(*mods), GFP_KERNEL);
+	/* shortcut: keep mods pointer in the file */
+	file->private_data = mods;
+	return 0;
+}
+
+/*
+ * Updates of the modules from contexts that can't sleep are deferred to
+ * a task work of current, which runs before it returns to user space.
+ */
+static int (*task_work_add_fn)(struct task_struct *task,
+			       struct callback_head *twork, bool notify);
+
+enum {
+	KUNW_WORK_RESCAN,		/* new executable code was mapped */
+	KUNW_WORK_UNMAP,		/* [start, start + len) was unmapped */
+	KUNW_WORK_LOAD,			/* unwinds need unloaded modules */
+};
+
+struct kunwind_task_work {
+	struct callback_head twork;
+	int op;
+	unsigned long start;
+	unsigned long len;
+};
+
+static void kunwind_task_work_fn(struct callback_head *twork)
+{
+	struct kunwind_task_work *work =
+		container_of(twork, struct kunwind_task_work, twork);
+	struct kunwind_proc_modules *mods;
+
+	/* the task work also runs on exit, after the mm is released */
+	if (!current->mm)
+		goto out;
+
+	/* the updates take the mappings lock, files may close meanwhile */
+	mods = kunwind_process_get(current->mm);
 	if (!mods)
-		return -ENOMEM;
+		goto out;
+	switch (work->op) {
+	case KUNW_WORK_RESCAN:
+		init_modules_from_task(current, mods);
+		break;
+	case KUNW_WORK_UNMAP:
+		kunwind_module_remove(mods, work->start, work->len);
+		break;
+	case KUNW_WORK_LOAD:
+		WRITE_ONCE(mods->load_queued, 0);
+		kunwind_modules_load(current, mods);
+		break;
+	}
+	kunwind_process_unregister(mods);
+out:
+	kfree(work);
+}
 
-	compat = _stp_is_compat_task();
-	ret = init_proc_unwind_info(mods, compat);
-	if (ret) {
-		kfree(mods);
-		return ret;
+/* Not from NMI context */
+static int kunwind_task_work_queue(int op, unsigned long start,
+		unsigned long len)
+{
+	struct kunwind_task_work *work;
+
+	if (!task_work_add_fn)
+		return -ENOSYS;
+	work = kmalloc(sizeof(*work), GFP_NOWAIT);
+	if (!work)
+		return -ENOMEM;
+	init_task_work(&work->twork, kunwind_task_work_fn);
+	work->op = op;
+	work->start = start;
+	work->len = len;
+	if (task_work_add_fn(current, &work->twork, true)) {
+		kfree(work);
+		return -ESRCH;
 	}
-	hash_init(mods->unw_cache);
+	return 0;
+}
 
-	unw_cache_test(mods);
+/*
+ * An unwind of task returned -EAGAIN where it can't sleep, load the
+ * wanted modules once current, in the same address space, can.
+ */
+static void kunwind_defer_load(struct kunwind_proc_modules *mods,
+		struct task_struct *task)
+{
+	if (in_nmi() || task->mm != current->mm
+	    || xchg(&mods->load_queued, 1))
+		return;
+	if (kunwind_task_work_queue(KUNW_WORK_LOAD, 0, 0))
+		WRITE_ONCE(mods->load_queued, 0);
+}
 
-	/* register process */
-	kunwind_process_register(mods, current->pid);
+/*
+ * Unwind current in the per-CPU scratch buffer, loading the modules
+ * the unwind needs on the way. Returns with preemption disabled.
+ */
+static int kunwind_current_unwind(struct kunwind_backtrace *bt,
+		struct kunwind_proc_modules *mods)
+{
+	int ret;
 
-	/* shortcut: keep mods pointer in the file */
-	file->private_data = mods;
-	return ret;
+	for (;;) {
+		preempt_disable();
+		bt->entries = kunwind_scratch_entries();
+		ret = do_current_unwind(bt, mods);
+		if (ret != -EAGAIN)
+			return ret;
+		preempt_enable();
+		/* each round loads or gives up on the wanted modules */
+		kunwind_modules_load(current, mods);
+	}
 }
 
 static int kunwind_debug_release(struct inode *inode, struct file *file)
 {
-	kunwind_process_unregister(current->pid);
+	kunwind_process_unregister(file->private_data);
 	file->private_data = NULL;
 	return 0;
 }
@@ -156,7 +375,9 @@ static long kunwind_proc_info_ioctl(struct file *file,
 	// probably adds unnecessary overhead. lttng has
 	// TIF_KERNEL_TRACE, see
 	// http://lkml.iu.edu/hypermail/linux/kernel/0903.1/03592.html
-	current_thread_info()->flags |= _TIF_SYSCALL_AUDIT;
+	err = kunwind_thread_register(mods);
+	if (err < 0)
+		return err;
 
 	if (!upinfo)
 		return kunwind_init_ioctl(file);
@@ -173,7 +394,16 @@ static long kunwind_proc_info_ioctl(struct file *file,
 		goto KUNWIND_PROC_INFO_IOCTL_ERR;
 	}
 
+	if (size < sizeof(*pinfo) || pinfo->nr_load_segments >
+	    (size - sizeof(*pinfo)) / sizeof(pinfo->load_segments[0])) {
+		err = -EINVAL;
+		goto KUNWIND_PROC_INFO_IOCTL_ERR;
+	}
+
 	res = init_modules_from_proc_info(pinfo, current, mods);
+	if (!res && (pinfo->flags & KUNWIND_PINFO_COMPILE))
+		res = compile_unwind_tables(current, mods);
+	kunwind_tails_reset(mods);
 	kfree(pinfo);
 	return res;
 
@@ -182,17 +412,59 @@ KUNWIND_PROC_INFO_IOCTL_ERR:
 	return err;
 }
 
+/*
+ * Copy the entries of a backtrace unwound in the per-CPU scratch buffer,
+ * with preemption disabled. If the user buffer faults, fall back to a
+ * copy with preemption enabled. Always enables preemption.
+ */
+static int copy_backtrace_to_user(u64 __user *uentries,
+		struct kunwind_backtrace *bt)
+{
+	unsigned long size = bt->nr_entries * sizeof(*bt->entries);
+	unsigned long left;
+	u64 *entries;
+
+	/* the inatomic copy doesn't check the range */
+	if (!access_ok(VERIFY_WRITE, uentries, size)) {
+		preempt_enable();
+		return -EFAULT;
+	}
+	pagefault_disable();
+	left = __copy_to_user_inatomic(uentries, bt->entries, size);
+	pagefault_enable();
+	if (!left) {
+		preempt_enable();
+		return 0;
+	}
+
+	entries = kmalloc(size, GFP_ATOMIC);
+	if (entries)
+		memcpy(entries, bt->entries, size);
+	preempt_enable();
+	if (!entries)
+		return -ENOMEM;
+	left = copy_to_user(uentries, entries, size);
+	kfree(entries);
+	return left ? -EFAULT : 0;
+}
+
+/*
+ * Unwind the caller. With modoff, the entries are module ids and
+ * offsets instead of pcs.
+ */
 static long kunwind_backtrace_ioctl(struct file *file,
-		struct kunwind_backtrace __user *uback)
+		struct kunwind_backtrace __user *uback, int modoff)
 {
 	struct kunwind_proc_modules *mods = file->private_data;
 	struct kunwind_backtrace bt;
+	u64 __user *uentries;
 	int ret;
 
 	dbug_unwind(1, "kunwind_backtrace_ioctl entry\n");
 
 	memset(&bt, 0, sizeof(bt));
-	if (get_user(bt.max_entries, &uback->max_entries))
+	if (get_user(bt.max_entries, &uback->max_entries)
+	    || get_user(uentries, &uback->entries))
 		return -EFAULT;
 
 	dbug_unwind(1, "max_entries=%d\n", bt.max_entries);
@@ -200,67 +472,609 @@ static long kunwind_backtrace_ioctl(struct file *file,
 		return -EINVAL;
 
 	/* Clamp memory usage */
-	bt.max_entries = min(bt.max_entries, entries_limit);
-	bt.entries = kmalloc(bt.max_entries * sizeof(*bt.entries), GFP_KERNEL);
-	if (!bt.entries)
-		return -ENOMEM;
+	bt.max_entries = min_t(u32, bt.max_entries, KUNWIND_MAX_ENTRIES);
 
-	ret = do_current_unwind(&bt, mods);
-	if (ret) {
+	/*
+	 * Unwind in the per-CPU scratch buffer, no allocation. The frames
+	 * found before a failure are returned, the status tells the reason.
+	 */
+	ret = kunwind_current_unwind(&bt, mods);
+	if (ret && !bt.nr_entries) {
+		preempt_enable();
 		dbug_unwind(1, "kunwind_backtrace unwind failed %d\n", ret);
 		ret = -EFAULT;
 		goto out;
 	}
 
-	if (put_user(bt.nr_entries, &uback->nr_entries)) {
-		ret = -EFAULT;
+	if (modoff)
+		kunwind_backtrace_modoff(mods, &bt);
+	ret = copy_backtrace_to_user(uentries, &bt);
+	if (ret)
 		goto out;
-	}
 
-	if (copy_to_user(uback->entries, bt.entries,
-			bt.nr_entries * sizeof(*bt.entries))) {
+	if (put_user(bt.nr_entries, &uback->nr_entries)
+	    || put_user(bt.status, &uback->status))
 		ret = -EFAULT;
-		goto out;
-	}
 
 out:
-	kfree(bt.entries);
 	dbug_unwind(1, "kunwind_backtrace_ioctl end %d\n", ret);
 	return ret;
 }
 
-void save_stack_trace_kunwind(struct stack_trace *trace)
+/*
+ * Unwind task in the per-CPU scratch buffer and append it to the ring,
+ * or count it in the stack map in profile mode.
+ */
+static int kunwind_record(struct kunwind_proc_modules *mods,
+		struct task_struct *task, struct pt_regs *regs)
+{
+	/* the stack map is set before the profile mode */
+	int profile = smp_load_acquire(&mods->profile);
+	struct kunwind_ring *ring = smp_load_acquire(&mods->ring);
+	struct kunwind_stackmap *map = smp_load_acquire(&mods->stackmap);
+	struct kunwind_backtrace bt = {
+		.max_entries = KUNWIND_MAX_ENTRIES,
+	};
+	u32 stack_id = 0;
+	int ret;
+
+	if (!ring && !profile)
+		return -ENODEV;
+
+	preempt_disable();
+	bt.entries = kunwind_scratch_entries();
+	ret = do_task_unwind(task, regs, &bt, mods);
+	if (ret == -EAGAIN)
+		kunwind_defer_load(mods, task);
+	/* keep the frames found before an error */
+	if (bt.nr_entries && profile) {
+		ret = kunwind_stackmap_count(map, bt.entries, bt.nr_entries);
+	} else if (bt.nr_entries) {
+		/* fall back to the entries if the stack can't be interned */
+		if (map && (ring->flags & KUNWIND_RING_STACK_IDS))
+			stack_id = kunwind_stackmap_intern(map, bt.entries,
+							   bt.nr_entries);
+		ret = kunwind_ring_write(ring, task->pid, stack_id,
+					 bt.entries, bt.nr_entries);
+	}
+	preempt_enable();
+	return ret;
+}
+
+/*
+ * Record a backtrace of task in the ring of its process. Same calling
+ * constraints as kunwind_unwind_task().
+ */
+int kunwind_record_task(struct task_struct *task, struct pt_regs *regs)
 {
 	int ret;
-	int hash;
-	struct kunw_map_key key;
 	struct kunw_map_val *val;
+
+	rcu_read_lock();
+	val = task->mm ? kunwind_process_find(task->mm) : NULL;
+	ret = val ? kunwind_record(val->mods, task, regs) : -ESRCH;
+	rcu_read_unlock();
+	return ret;
+}
+EXPORT_SYMBOL_GPL(kunwind_record_task);
+
+/*
+ * Syscall entry probe, shared by the processes whose ring records the
+ * syscalls. The syscall slow path saves the full pt_regs.
+ */
+static DEFINE_MUTEX(kunwind_syscalls_lock);
+static unsigned int kunwind_syscalls_users;
+static struct tracepoint *sys_enter_tp;
+static struct tracepoint *sys_exit_tp;
+
+/* The record ioctl records its caller itself */
+static bool kunwind_syscall_is_record(struct pt_regs *regs, long id)
+{
+	unsigned long cmd;
+
+#ifdef CONFIG_IA32_EMULATION
+	if (in_compat_syscall()) {
+		if (id != __NR_ia32_ioctl)
+			return false;
+	} else
+#endif
+	if (id != __NR_ioctl)
+		return false;
+	syscall_get_arguments(current, regs, 1, 1, &cmd);
+	return (unsigned int) cmd == KUNWIND_RECORD_IOCTL;
+}
+
+static void kunwind_sys_enter(void *data, struct pt_regs *regs, long id)
+{
+	struct kunw_map_val *val;
+	struct kunwind_ring *ring;
+
+	if (!current->mm || kunwind_syscall_is_record(regs, id))
+		return;
+
+	rcu_read_lock();
+	val = kunwind_process_find(current->mm);
+	if (val) {
+		ring = smp_load_acquire(&val->mods->ring);
+		if (ring && (ring->flags & KUNWIND_RING_SYSCALLS))
+			kunwind_record(val->mods, current, regs);
+	}
+	rcu_read_unlock();
+}
+
+static void find_syscall_tp(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sys_enter"))
+		sys_enter_tp = tp;
+	else if (!strcmp(tp->name, "sys_exit"))
+		sys_exit_tp = tp;
+}
+
+static int kunwind_syscalls_get(void)
+{
+	int err = 0;
+
+	mutex_lock(&kunwind_syscalls_lock);
+	if (kunwind_syscalls_users == 0) {
+		if (!sys_enter_tp)
+			for_each_kernel_tracepoint(find_syscall_tp, NULL);
+		if (!sys_enter_tp)
+			err = -ENOSYS;
+		else
+			err = tracepoint_probe_register(sys_enter_tp,
+					kunwind_sys_enter, NULL);
+	}
+	if (!err)
+		kunwind_syscalls_users++;
+	mutex_unlock(&kunwind_syscalls_lock);
+	return err;
+}
+
+static void kunwind_syscalls_put(void)
+{
+	mutex_lock(&kunwind_syscalls_lock);
+	if (--kunwind_syscalls_users == 0) {
+		tracepoint_probe_unregister(sys_enter_tp, kunwind_sys_enter,
+					    NULL);
+		tracepoint_synchronize_unregister();
+	}
+	mutex_unlock(&kunwind_syscalls_lock);
+}
+
+/*
+ * The modules of the processes that track their mappings are updated
+ * when a syscall maps executable code or unmaps memory. The probe
+ * can't sleep, the update runs as a task work before the syscall
+ * returns to user space.
+ */
+static unsigned int kunwind_mmap_users;
+
+static void kunwind_sys_exit(void *data, struct pt_regs *regs, long ret)
+{
+	struct kunw_map_val *val;
+	unsigned long args[3];
+	unsigned long start, len = 0;
+
+	if (IS_ERR_VALUE(ret) || in_compat_syscall())
+		return;
+
+	syscall_get_arguments(current, regs, 0, 3, args);
+	switch (syscall_get_nr(current, regs)) {
+	case __NR_mmap:
+		start = ret;
+		if (!(args[2] & PROT_EXEC))
+			return;
+		break;
+	case __NR_mprotect:
+		start = args[0];
+		if (!(args[2] & PROT_EXEC))
+			return;
+		break;
+	case __NR_munmap:
+		start = args[0];
+		len = args[1];
+		if (!len)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	rcu_read_lock();
+	val = kunwind_process_find(current->mm);
+	if (val && READ_ONCE(val->mods->track_mmap))
+		kunwind_task_work_queue(len ? KUNW_WORK_UNMAP : KUNW_WORK_RESCAN,
+					start, len);
+	rcu_read_unlock();
+}
+
+static int kunwind_mmap_track_get(void)
+{
+	int err = 0;
+
+	mutex_lock(&kunwind_syscalls_lock);
+	if (kunwind_mmap_users == 0) {
+		if (!sys_exit_tp)
+			for_each_kernel_tracepoint(find_syscall_tp, NULL);
+		if (!sys_exit_tp || !task_work_add_fn)
+			err = -ENOSYS;
+		else
+			err = tracepoint_probe_register(sys_exit_tp,
+					kunwind_sys_exit, NULL);
+	}
+	if (!err)
+		kunwind_mmap_users++;
+	mutex_unlock(&kunwind_syscalls_lock);
+	return err;
+}
+
+static void kunwind_mmap_track_put(void)
+{
+	mutex_lock(&kunwind_syscalls_lock);
+	if (--kunwind_mmap_users == 0) {
+		tracepoint_probe_unregister(sys_exit_tp, kunwind_sys_exit,
+					    NULL);
+		tracepoint_synchronize_unregister();
+	}
+	mutex_unlock(&kunwind_syscalls_lock);
+}
+
+static long kunwind_mmap_track_ioctl(struct file *file)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	int err;
+
+	if (cmpxchg(&mods->track_mmap, 0, 1))
+		return 0;
+	err = kunwind_mmap_track_get();
+	if (err)
+		WRITE_ONCE(mods->track_mmap, 0);
+	return err;
+}
+
+static long kunwind_module_add_ioctl(struct file *file,
+		struct load_info __user *ulinfo)
+{
+	struct load_info linfo;
+
+	if (copy_from_user(&linfo, ulinfo, sizeof(linfo)))
+		return -EFAULT;
+	return kunwind_module_add(file->private_data, current, &linfo);
+}
+
+static long kunwind_module_remove_ioctl(struct file *file,
+		struct kunwind_range __user *urange)
+{
+	struct kunwind_range range;
+
+	if (copy_from_user(&range, urange, sizeof(range)))
+		return -EFAULT;
+	if (!range.len)
+		return -EINVAL;
+	return kunwind_module_remove(file->private_data, range.start,
+				     range.len);
+}
+
+static long kunwind_ring_ioctl(struct file *file,
+		struct kunwind_ring_params __user *uparams)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_ring_params params;
+	struct kunwind_ring *ring;
+	int err;
+
+	if (copy_from_user(&params, uparams, sizeof(params)))
+		return -EFAULT;
+
+	ring = kunwind_ring_create(&params);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+
+	/* the flags are read by the probes once the ring is published */
+	err = 0;
+	if (ring->flags & KUNWIND_RING_SYSCALLS) {
+		err = kunwind_syscalls_get();
+		if (err)
+			/* keep the ring, without syscall records */
+			ring->flags &= ~KUNWIND_RING_SYSCALLS;
+	}
+
+	if (cmpxchg(&mods->ring, NULL, ring)) {
+		if (ring->flags & KUNWIND_RING_SYSCALLS)
+			kunwind_syscalls_put();
+		kunwind_ring_free(ring);
+		return -EBUSY;
+	}
+	return err;
+}
+
+static int kunwind_debug_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_ring *ring = smp_load_acquire(&mods->ring);
+
+	if (!ring)
+		return -ENODEV;
+	return kunwind_ring_mmap(ring, vma);
+}
+
+static long kunwind_stackmap_ioctl(struct file *file, u32 max_stacks)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_stackmap *map;
+
+	map = kunwind_stackmap_create(max_stacks);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+
+	if (cmpxchg(&mods->stackmap, NULL, map)) {
+		kunwind_stackmap_free(map);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* Unwind the caller, returns the id of its stack */
+static long kunwind_stack_id_ioctl(struct file *file)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_stackmap *map = smp_load_acquire(&mods->stackmap);
 	struct kunwind_backtrace bt = {
-		.max_entries = trace->max_entries,
-		.nr_entries = trace->nr_entries,
-		.entries = (u64 *) trace->entries,
+		.max_entries = KUNWIND_MAX_ENTRIES,
 	};
+	long ret;
+
+	if (!map)
+		return -ENODEV;
+
+	ret = kunwind_current_unwind(&bt, mods);
+	if (bt.nr_entries) {
+		ret = kunwind_stackmap_intern(map, bt.entries, bt.nr_entries);
+		if (!ret)
+			ret = -ENOSPC;
+	} else if (!ret) {
+		ret = -ENOENT;
+	}
+	preempt_enable();
+	return ret;
+}
+
+static long kunwind_stack_get_ioctl(struct file *file,
+		struct kunwind_stack_query __user *uquery)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_stackmap *map = smp_load_acquire(&mods->stackmap);
+	const struct kunwind_stack *stack;
+	struct kunwind_stack_query query;
+	u32 nr;
+
+	if (!map)
+		return -ENODEV;
+	if (copy_from_user(&query, uquery, sizeof(query)))
+		return -EFAULT;
+
+	stack = kunwind_stackmap_lookup(map, query.id);
+	if (!stack)
+		return -ENOENT;
+
+	/* stacks are immutable once interned */
+	nr = min(stack->nr_entries, query.max_entries);
+	if (copy_to_user(query.entries, stack->entries,
+			 nr * sizeof(*stack->entries))
+	    || put_user(nr, &uquery->nr_entries))
+		return -EFAULT;
+	return 0;
+}
+
+static long kunwind_profile_ioctl(struct file *file)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+
+	if (!smp_load_acquire(&mods->stackmap))
+		return -ENODEV;
+	smp_store_release(&mods->profile, 1);
+	return 0;
+}
+
+static long kunwind_profile_drain_ioctl(struct file *file,
+		struct kunwind_profile_drain __user *udrain)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_stackmap *map = smp_load_acquire(&mods->stackmap);
+	struct kunwind_stack_count *counts;
+	struct kunwind_profile_drain drain;
+	long ret = 0;
+	u32 nr;
+
+	if (!map || !READ_ONCE(mods->profile))
+		return -ENODEV;
+	if (copy_from_user(&drain, udrain, sizeof(drain)))
+		return -EFAULT;
+
+	drain.max_entries = min_t(u32, drain.max_entries, map->max);
+	if (!drain.max_entries)
+		return -EINVAL;
+	counts = vmalloc(drain.max_entries * sizeof(*counts));
+	if (!counts)
+		return -ENOMEM;
+
+	/* the counts drained are lost if the copy fails */
+	nr = kunwind_stackmap_drain(map, counts, drain.max_entries);
+	if (copy_to_user(drain.entries, counts, nr * sizeof(*counts))
+	    || put_user(nr, &udrain->nr_entries)
+	    || put_user(atomic64_xchg(&map->lost, 0), &udrain->lost))
+		ret = -EFAULT;
+	vfree(counts);
+	return ret;
+}
+
+static long kunwind_module_table_ioctl(struct file *file,
+		struct kunwind_module_table __user *utable)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_module_desc *descs = NULL;
+	struct kunwind_module_table table;
+	long ret = 0;
+	u32 nr;
+
+	if (copy_from_user(&table, utable, sizeof(table)))
+		return -EFAULT;
+
+	/* max_entries 0 only returns the number of modules */
+	table.max_entries = min_t(u32, table.max_entries, KUNWIND_MAX_MODULES);
+	if (table.max_entries) {
+		descs = vzalloc(table.max_entries * sizeof(*descs));
+		if (!descs)
+			return -ENOMEM;
+	}
+
+	nr = kunwind_module_table(mods, descs, table.max_entries);
+	if (copy_to_user(table.entries, descs,
+			 min(nr, table.max_entries) * sizeof(*descs))
+	    || put_user(nr, &utable->nr_entries))
+		ret = -EFAULT;
+	vfree(descs);
+	return ret;
+}
+
+/* Upper bound on the size of the tables loaded from user space */
+#define KUNWIND_TABLE_MAX_SIZE (64 << 20)
+
+static long kunwind_table_export_ioctl(struct file *file,
+		struct kunwind_table_blob __user *ublob)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_table_blob blob;
+	void *table;
+	long ret;
+	u32 size;
+
+	if (copy_from_user(&blob, ublob, sizeof(blob)))
+		return -EFAULT;
+	size = blob.size;
+	ret = kunwind_table_export(mods, &blob, &table);
+	if (ret)
+		return ret;
+	if (table && blob.size > size)
+		ret = -ENOSPC;
+	else if (table && copy_to_user(blob.buf, table, blob.size))
+		ret = -EFAULT;
+	vfree(table);
+	/* the size is also returned with -ENOSPC */
+	if (ret != -EFAULT && copy_to_user(ublob, &blob, sizeof(blob)))
+		ret = -EFAULT;
+	return ret;
+}
+
+static long kunwind_table_import_ioctl(struct file *file,
+		struct kunwind_table_blob __user *ublob)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_table_blob blob;
+	void *table;
+	long ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&blob, ublob, sizeof(blob)))
+		return -EFAULT;
+	if (!blob.size || blob.size > KUNWIND_TABLE_MAX_SIZE)
+		return -EINVAL;
+
+	table = vmalloc(blob.size);
+	if (!table)
+		return -ENOMEM;
+	if (copy_from_user(table, blob.buf, blob.size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ret = kunwind_table_import(mods, &blob, table);
+	if (copy_to_user(ublob, &blob, sizeof(blob)))
+		ret = -EFAULT;
+out:
+	vfree(table);
+	return ret;
+}
 
-	key.tgid = current->pid;
-	hash = jhash(&key, sizeof(key), 0);
+static long kunwind_cache_stats_ioctl(struct file *file,
+		struct kunwind_cache_stats __user *ustats)
+{
+	struct kunwind_proc_modules *mods = file->private_data;
+	struct kunwind_cache_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	unw_cache_get_stats(mods, &stats);
+	if (copy_to_user(ustats, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Unwind the user stack of a task of a registered process, from a
+ * snapshot of its registers. The task must share the address space of
+ * current, as it does at sched_switch or in a perf sampling interrupt.
+ * Doesn't sleep. Returns -EAGAIN with the frames found so far when the
+ * unwind reaches a module not loaded yet, it is loaded before current
+ * returns to user space.
+ */
+int kunwind_unwind_task(struct task_struct *task, struct pt_regs *regs,
+			struct kunwind_backtrace *bt)
+{
+	int ret;
+	struct kunw_map_val *val;
+
+	if (!task->mm)
+		return -EINVAL;
 
 	rcu_read_lock();
-	val = kunwind_process_find(&key, hash);
+	val = kunwind_process_find(task->mm);
 	if (!val) {
 		rcu_read_unlock();
-		dbug_unwind(1, "process not registered pid=%d\n", key.tgid);
-		return;
+		dbug_unwind(1, "process not registered tgid=%d\n", task->tgid);
+		return -ESRCH;
 	}
-	ret = do_current_unwind(&bt, val->mods);
+	ret = do_task_unwind(task, regs, bt, val->mods);
+	if (ret == -EAGAIN)
+		kunwind_defer_load(val->mods, task);
 	rcu_read_unlock();
+	return ret;
+}
+EXPORT_SYMBOL_GPL(kunwind_unwind_task);
+
+void save_stack_trace_kunwind(struct stack_trace *trace)
+{
+	struct kunwind_backtrace bt = {
+		.max_entries = trace->max_entries,
+		.nr_entries = trace->nr_entries,
+		.entries = (u64 *) trace->entries,
+	};
+
+	kunwind_unwind_task(current, current_pt_regs(), &bt);
 	trace->nr_entries = bt.nr_entries;
 }
 EXPORT_SYMBOL_GPL(save_stack_trace_kunwind);
 
 long kunwind_debug_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+	int ret;
+
 	dbug_unwind(1, "ioctl file=%p cmd=%x arg=%lx\n", file, cmd, arg);
 
+	/*
+	 * Any thread of the process can use the file. A thread not
+	 * registered yet retries once it is.
+	 */
+	switch (cmd) {
+	case KUNWIND_UNWIND_IOCTL:
+	case KUNWIND_UNWIND_MODOFF_IOCTL:
+	case KUNWIND_RECORD_IOCTL:
+	case KUNWIND_STACK_ID_IOCTL:
+		ret = kunwind_thread_register(file->private_data);
+		if (ret)
+			return ret < 0 ? ret : -EAGAIN;
+		break;
+	}
+
 	switch (cmd) {
 	case KUNWIND_PROC_INFO_IOCTL:
 		dbug_unwind(1, "kunwind init process\n");
@@ -269,7 +1083,53 @@ long kunwind_debug_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case KUNWIND_UNWIND_IOCTL:
 		dbug_unwind(1, "kunwind backtrace\n");
 		return kunwind_backtrace_ioctl(file,
-		                (struct kunwind_backtrace __user *) arg);
+		                (struct kunwind_backtrace __user *) arg, 0);
+	case KUNWIND_UNWIND_MODOFF_IOCTL:
+		return kunwind_backtrace_ioctl(file,
+				(struct kunwind_backtrace __user *) arg, 1);
+	case KUNWIND_RING_IOCTL:
+		return kunwind_ring_ioctl(file,
+				(struct kunwind_ring_params __user *) arg);
+	case KUNWIND_RECORD_IOCTL:
+		return kunwind_record(file->private_data, current,
+				current_pt_regs());
+	case KUNWIND_STACKMAP_IOCTL:
+		return kunwind_stackmap_ioctl(file, arg);
+	case KUNWIND_STACK_ID_IOCTL:
+		return kunwind_stack_id_ioctl(file);
+	case KUNWIND_STACK_GET_IOCTL:
+		return kunwind_stack_get_ioctl(file,
+				(struct kunwind_stack_query __user *) arg);
+	case KUNWIND_CACHE_STATS_IOCTL:
+		return kunwind_cache_stats_ioctl(file,
+				(struct kunwind_cache_stats __user *) arg);
+	case KUNWIND_INCREMENTAL_IOCTL:
+		return kunwind_tails_create(file->private_data);
+	case KUNWIND_MODULE_ADD_IOCTL:
+		return kunwind_module_add_ioctl(file,
+				(struct load_info __user *) arg);
+	case KUNWIND_MODULE_REMOVE_IOCTL:
+		return kunwind_module_remove_ioctl(file,
+				(struct kunwind_range __user *) arg);
+	case KUNWIND_MODULES_TRACK_IOCTL:
+		return kunwind_mmap_track_ioctl(file);
+	case KUNWIND_MODULE_TABLE_IOCTL:
+		return kunwind_module_table_ioctl(file,
+				(struct kunwind_module_table __user *) arg);
+	case KUNWIND_THREAD_IOCTL:
+		ret = kunwind_thread_register(file->private_data);
+		return ret < 0 ? ret : 0;
+	case KUNWIND_PROFILE_IOCTL:
+		return kunwind_profile_ioctl(file);
+	case KUNWIND_PROFILE_DRAIN_IOCTL:
+		return kunwind_profile_drain_ioctl(file,
+				(struct kunwind_profile_drain __user *) arg);
+	case KUNWIND_TABLE_EXPORT_IOCTL:
+		return kunwind_table_export_ioctl(file,
+				(struct kunwind_table_blob __user *) arg);
+	case KUNWIND_TABLE_IMPORT_IOCTL:
+		return kunwind_table_import_ioctl(file,
+				(struct kunwind_table_blob __user *) arg);
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -281,6 +1141,7 @@ static struct file_operations fops = {
 	.open = kunwind_debug_open,
 	.release = kunwind_debug_release,
 	.unlocked_ioctl = kunwind_debug_ioctl,
+	.mmap = kunwind_debug_mmap,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = kunwind_debug_ioctl,
 #endif
@@ -290,9 +1151,33 @@ static struct proc_dir_entry *proc_entry;
 
 static int __init kunwind_debug_init(void)
 {
+	int err;
+
 	printk(KERN_INFO "kunwind_debug init\n");
+	/* not exported, without it the modules are only loaded in ioctls */
+	task_work_add_fn = (void *) kallsyms_lookup_name("task_work_add");
+	err = unw_cache_module_init();
+	if (err)
+		return err;
+	err = kunwind_contexts_init();
+	if (err)
+		goto out_cache;
+	err = rhashtable_init(&kunw_map, &kunw_map_params);
+	if (err)
+		goto out_contexts;
+	err = kunwind_stats_init();
+	if (err)
+		goto out_map;
 	proc_entry = proc_create(PROC_FILENAME, 0666, NULL, &fops);
 	return 0;
+
+out_map:
+	rhashtable_destroy(&kunw_map);
+out_contexts:
+	kunwind_contexts_exit();
+out_cache:
+	unw_cache_module_exit();
+	return err;
 }
 
 module_init(kunwind_debug_init);
@@ -301,6 +1186,11 @@ static void __exit kunwind_debug_exit(void)
 {
 	printk(KERN_INFO "kunwind_debug exit\n");
 	proc_remove(proc_entry);
+	kunwind_stats_exit();
+	rhashtable_destroy(&kunw_map);
+	kunwind_contexts_exit();
+	kunwind_modules_exit();
+	unw_cache_module_exit();
 }
 
 module_exit(kunwind_debug_exit);
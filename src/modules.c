@@ -1,263 +1,905 @@
 #include <linux/elf.h>
 #include <linux/errno.h>
 #include <linux/list.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/hardirq.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/ptrace.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
 #include "modules.h"
 
+#include "build_id.h"
 #include "debug.h"
 #include "iterate_phdr.h"
+#include "ring.h"
+#include "stackmap.h"
+#include "stats.h"
 #include "vma_file_path.h"
 #include "unwind/unwind.h"
 
+/* Upper bound on the number of cached rules per process */
+static unsigned int unw_cache_max_entries = 4096;
+module_param(unw_cache_max_entries, uint, 0644);
+MODULE_PARM_DESC(unw_cache_max_entries,
+		 "Maximum number of cached unwind rules per process");
+
+static struct kmem_cache *unw_cache_entry_cachep;
+
+int unw_cache_module_init(void)
+{
+	unw_cache_entry_cachep = KMEM_CACHE(unw_cache_entry, 0);
+	if (!unw_cache_entry_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+void unw_cache_module_exit(void)
+{
+	/* wait for the pending unw_cache_entry_rcu_free() */
+	rcu_barrier();
+	kmem_cache_destroy(unw_cache_entry_cachep);
+}
+
 static void unw_cache_entry_rcu_free(struct rcu_head *rcu)
 {
 	struct unw_cache_entry *entry;
 
 	entry = container_of(rcu, struct unw_cache_entry, rcu);
-	kfree(entry);
+	kmem_cache_free(unw_cache_entry_cachep, entry);
 	dbug_unwind(3, "del cache_entry %p\n ", entry);
 }
 
-struct unw_cache_entry* unw_cache_find_entry(struct kunwind_proc_modules *mods,
+int unw_cache_init(struct unw_cache *cache)
+{
+	int i;
+
+	hash_init(cache->table);
+	for (i = 0; i < HASH_SIZE(cache->table); i++)
+		spin_lock_init(&cache->locks[i]);
+	atomic_set(&cache->nr, 0);
+	atomic_set(&cache->hand, 0);
+	cache->stats = alloc_percpu(struct unw_cache_stats);
+	if (!cache->stats)
+		return -ENOMEM;
+	return 0;
+}
+
+static inline unsigned int unw_cache_bucket(struct unw_cache *cache,
 		struct unw_cache_key *key)
 {
-	int hash;
+	unsigned long granule = key->pc >> UNW_CACHE_GRANULE_SHIFT;
+
+	return hash_min(jhash(&granule, sizeof(granule), 0),
+			HASH_BITS(cache->table));
+}
+
+static struct unw_cache_entry *__unw_cache_find(struct unw_cache *cache,
+		unsigned int bkt, struct unw_cache_key *key)
+{
 	struct unw_cache_entry *entry;
 
-	hash = jhash(key, sizeof(*key), 0);
-	hash_for_each_possible_rcu(mods->unw_cache, entry, hlist, hash) {
-		if (key->pc == entry->frame.pc)
+	hlist_for_each_entry_rcu(entry, &cache->table[bkt], hlist) {
+		if (key->pc >= entry->frame.start && key->pc < entry->frame.end)
 			return entry;
 	}
 	return NULL;
 }
 
-void unw_cache_add_entry(struct kunwind_proc_modules *mods,
-		struct tdep_frame *frame)
+/* Must be called under rcu_read_lock(), counts the hits and misses */
+struct unw_cache_entry* unw_cache_find_entry(struct unw_cache *cache,
+		struct unw_cache_key *key)
 {
-	int hash;
 	struct unw_cache_entry *entry;
-	struct unw_cache_key key = {
-		.pc = frame->pc,
-	};
 
-	entry = unw_cache_find_entry(mods, &key);
-	if (entry) {
-		dbug_unwind(1, "entry already in cache (pc=0x%lx)\n", frame->pc);
-		return;
+	entry = __unw_cache_find(cache, unw_cache_bucket(cache, key), key);
+	if (!entry) {
+		this_cpu_inc(cache->stats->misses);
+		return NULL;
+	}
+	this_cpu_inc(cache->stats->hits);
+	if (!READ_ONCE(entry->referenced))
+		WRITE_ONCE(entry->referenced, 1);
+	return entry;
+}
+
+/* Called with the bucket lock held */
+static void unw_cache_remove(struct unw_cache *cache,
+		struct unw_cache_entry *entry)
+{
+	hlist_del_rcu(&entry->hlist);
+	call_rcu(&entry->rcu, unw_cache_entry_rcu_free);
+	atomic_dec(&cache->nr);
+}
+
+/*
+ * CLOCK eviction: the hand sweeps the buckets, giving a second chance
+ * to the entries referenced since its last pass. Buckets locked by
+ * other writers are skipped. Returns 1 if an entry was evicted.
+ */
+static int unw_cache_evict(struct unw_cache *cache)
+{
+	struct unw_cache_entry *entry;
+	unsigned long flags;
+	unsigned int i, bkt;
+
+	for (i = 0; i < 2 * HASH_SIZE(cache->table); i++) {
+		bkt = atomic_inc_return(&cache->hand) &
+			(HASH_SIZE(cache->table) - 1);
+		local_irq_save(flags);
+		if (!spin_trylock(&cache->locks[bkt])) {
+			local_irq_restore(flags);
+			continue;
+		}
+		hlist_for_each_entry(entry, &cache->table[bkt], hlist) {
+			if (entry->referenced) {
+				entry->referenced = 0;
+				continue;
+			}
+			unw_cache_remove(cache, entry);
+			spin_unlock_irqrestore(&cache->locks[bkt], flags);
+			this_cpu_inc(cache->stats->evictions);
+			return 1;
+		}
+		spin_unlock_irqrestore(&cache->locks[bkt], flags);
 	}
+	return 0;
+}
 
-	hash = jhash(&key, sizeof(key), 0);
-	entry = kzalloc(sizeof(struct unw_cache_entry), GFP_KERNEL);
-	if (entry) {
-		entry->frame = *frame;
-		hash_add_rcu(mods->unw_cache, &entry->hlist, hash);
-		dbug_unwind(3, "add cache_entry %p\n ", entry);
+/* Add the rules of frame, hashed by the granule of the pc in key */
+void unw_cache_add_entry(struct unw_cache *cache,
+		struct unw_cache_key *key, struct tdep_frame *frame)
+{
+	struct unw_cache_entry *entry;
+	unsigned long flags;
+	unsigned int bkt;
+
+	/* neither the allocator nor the bucket locks are NMI safe */
+	if (!READ_ONCE(unw_cache_max_entries) || in_nmi())
+		return;
+
+	/* reserve a slot, making room if the cache is full */
+	if (atomic_inc_return(&cache->nr) > READ_ONCE(unw_cache_max_entries)
+	    && !unw_cache_evict(cache))
+		goto out_unreserve;
+
+	/* may be called from atomic context, under rcu_read_lock() */
+	entry = kmem_cache_alloc(unw_cache_entry_cachep,
+				 GFP_NOWAIT | __GFP_NOWARN);
+	if (!entry)
+		goto out_unreserve;
+	entry->frame = *frame;
+	entry->referenced = 0;
+
+	bkt = unw_cache_bucket(cache, key);
+	spin_lock_irqsave(&cache->locks[bkt], flags);
+	if (__unw_cache_find(cache, bkt, key)) {
+		/* another thread was faster */
+		spin_unlock_irqrestore(&cache->locks[bkt], flags);
+		dbug_unwind(1, "entry already in cache (pc=0x%lx)\n", key->pc);
+		kmem_cache_free(unw_cache_entry_cachep, entry);
+		goto out_unreserve;
 	}
+	hlist_add_head_rcu(&entry->hlist, &cache->table[bkt]);
+	spin_unlock_irqrestore(&cache->locks[bkt], flags);
+	dbug_unwind(3, "add cache_entry %p\n ", entry);
+	return;
+
+out_unreserve:
+	atomic_dec(&cache->nr);
 }
 
-void unw_cache_del_entry(struct kunwind_proc_modules *mods,
+void unw_cache_del_entry(struct unw_cache *cache,
 		struct unw_cache_key *key)
 {
 	struct unw_cache_entry *entry;
+	unsigned int bkt = unw_cache_bucket(cache, key);
+	unsigned long flags;
 
-	rcu_read_lock();
-	entry = unw_cache_find_entry(mods, key);
-	if (entry) {
-		hash_del_rcu(&entry->hlist);
-		call_rcu(&entry->rcu, unw_cache_entry_rcu_free);
-	}
-	rcu_read_unlock();
+	spin_lock_irqsave(&cache->locks[bkt], flags);
+	entry = __unw_cache_find(cache, bkt, key);
+	if (entry)
+		unw_cache_remove(cache, entry);
+	spin_unlock_irqrestore(&cache->locks[bkt], flags);
 }
 
-void unw_cache_clear(struct kunwind_proc_modules *mods)
+void unw_cache_clear(struct unw_cache *cache)
 {
 	struct unw_cache_entry *entry;
+	struct hlist_node *tmp;
+	unsigned long flags;
 	int bkt;
 
-	rcu_read_lock();
-	hash_for_each_rcu(mods->unw_cache, bkt, entry, hlist) {
-		hash_del_rcu(&entry->hlist);
-		call_rcu(&entry->rcu, unw_cache_entry_rcu_free);
+	for (bkt = 0; bkt < HASH_SIZE(cache->table); bkt++) {
+		spin_lock_irqsave(&cache->locks[bkt], flags);
+		hlist_for_each_entry_safe(entry, tmp, &cache->table[bkt], hlist)
+			unw_cache_remove(cache, entry);
+		spin_unlock_irqrestore(&cache->locks[bkt], flags);
 	}
-	rcu_read_unlock();
 	synchronize_rcu();
 }
 
+void unw_cache_destroy(struct unw_cache *cache)
+{
+	free_percpu(cache->stats);
+	cache->stats = NULL;
+}
+
+/*
+ * Sum the counters of the caches of the modules mapped by a process.
+ * The caches are shared, so they also account for the other processes
+ * mapping the same modules.
+ */
+void unw_cache_get_stats(struct kunwind_proc_modules *mods,
+		struct kunwind_cache_stats *stats)
+{
+	struct kunwind_mapping *map;
+	struct unw_cache *cache;
+	int cpu;
+
+	mutex_lock(&mods->lock);
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (!map->mod)
+			continue;
+		cache = &map->mod->unw_cache;
+		for_each_possible_cpu(cpu) {
+			struct unw_cache_stats *s = per_cpu_ptr(cache->stats, cpu);
+
+			stats->hits += s->hits;
+			stats->misses += s->misses;
+			stats->evictions += s->evictions;
+		}
+		stats->nr_entries += atomic_read(&cache->nr);
+	}
+	mutex_unlock(&mods->lock);
+	stats->max_entries = READ_ONCE(unw_cache_max_entries);
+}
+
 #ifdef DEBUG_UNWIND
-void unw_cache_dump(struct kunwind_proc_modules *mods)
+void unw_cache_dump(struct unw_cache *cache)
 {
 	struct unw_cache_entry *entry;
 	int bkt;
 
 	rcu_read_lock();
-	hash_for_each_rcu(mods->unw_cache, bkt, entry, hlist) {
+	hash_for_each_rcu(cache->table, bkt, entry, hlist) {
 		dbug_unwind(3, "dump cache_entry %p\n ", entry);
 	}
 	rcu_read_unlock();
 }
 
-void unw_cache_test(struct kunwind_proc_modules *mods)
+void unw_cache_test(void)
 {
+	struct unw_cache *cache;
 	struct unw_cache_entry *e;
 	struct tdep_frame frame = {
-		.pc = 0x1234,
+		.start = 0x1234,
+		.end = 0x1240,
 	};
 
 	struct unw_cache_key key = {
-		.pc = frame.pc,
+		.pc = frame.start,
 	};
 
+	cache = kmalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache || unw_cache_init(cache)) {
+		kfree(cache);
+		return;
+	}
+
 	dbug_unwind(3, "init\n");
-	unw_cache_dump(mods);
+	unw_cache_dump(cache);
 
-	unw_cache_add_entry(mods, &frame);
+	unw_cache_add_entry(cache, &key, &frame);
 	dbug_unwind(3, "after add\n");
-	unw_cache_dump(mods);
+	unw_cache_dump(cache);
 
 	rcu_read_lock();
-	e = unw_cache_find_entry(mods, &key);
+	e = unw_cache_find_entry(cache, &key);
 	dbug_unwind(3, "find_entry %p\n", e);
 	rcu_read_unlock();
 
-	unw_cache_clear(mods);
+	unw_cache_clear(cache);
 	dbug_unwind(3, "after clear\n");
-	unw_cache_dump(mods);
+	unw_cache_dump(cache);
 
 	rcu_read_lock();
-	e = unw_cache_find_entry(mods, &key);
+	e = unw_cache_find_entry(cache, &key);
 	dbug_unwind(3, "find_entry %p\n", e);
 	rcu_read_unlock();
 
 	dbug_unwind(3, "add and del\n");
-	unw_cache_add_entry(mods, &frame);
-	unw_cache_add_entry(mods, &frame);
-	unw_cache_dump(mods);
-	unw_cache_del_entry(mods, &key);
-	unw_cache_dump(mods);
+	unw_cache_add_entry(cache, &key, &frame);
+	unw_cache_add_entry(cache, &key, &frame);
+	unw_cache_dump(cache);
+	unw_cache_del_entry(cache, &key);
+	unw_cache_dump(cache);
+
+	unw_cache_clear(cache);
+	unw_cache_destroy(cache);
+	kfree(cache);
 }
 #else
-void unw_cache_test(struct kunwind_proc_modules *mods) { }
-void unw_cache_dump(struct kunwind_proc_modules *mods) { }
+void unw_cache_test(void) { }
+void unw_cache_dump(struct unw_cache *cache) { }
 #endif
 
 /*
- * linfo must at least have eh_frame_hdr_addr and eh_frame_hdr_len
+ * Registry of the loaded modules, shared by all the processes. It is
+ * only used when processes register or release modules.
  */
-static int init_kunwind_stp_module(struct task_struct *task,
-		struct load_info *linfo,
-		struct kunwind_module *mod,
-		struct kunwind_proc_modules *proc)
+#define KUNW_REGISTRY_BITS 6
+static DEFINE_HASHTABLE(kunw_registry, KUNW_REGISTRY_BITS);
+static DEFINE_MUTEX(kunw_registry_lock);
+
+/*
+ * Modules no process uses anymore stay in the registry with their
+ * tables and their rule cache, so that a restarted process finds them
+ * ready. They keep their file, and with it the inode of their key. The
+ * least recently released are unloaded first.
+ */
+static unsigned int kunw_retained_modules = 32;
+
+static LIST_HEAD(kunw_retained);	/* most recently released first */
+static unsigned int kunw_nr_retained;
+
+static void kunwind_modules_trim(unsigned int max);
+
+/* Lowering the limit unloads the modules retained over it */
+static int kunw_retained_modules_set(const char *val,
+		const struct kernel_param *kp)
 {
-	int i;
-	int res;
-	unsigned long npages;
-	struct page **pages;
-	unsigned long test;
+	int err = param_set_uint(val, kp);
 
-	// Get vma for this module
-	// (executable phdr with eh_frame and eh_frame_hdr section)
-	mod->elf_vma = find_vma(task->mm, linfo->eh_frame_hdr_ubuf);
+	if (!err)
+		kunwind_modules_trim(READ_ONCE(kunw_retained_modules));
+	return err;
+}
+
+static const struct kernel_param_ops kunw_retained_modules_ops = {
+	.set = kunw_retained_modules_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(kunw_retained_modules, &kunw_retained_modules_ops,
+		&kunw_retained_modules, 0644);
+MODULE_PARM_DESC(kunw_retained_modules,
+		 "Maximum number of unused modules kept loaded");
+
+/*
+ * What loading a module needs of its vma. The sections are copied from
+ * user space, which can fault, so this is read under mmap_sem and the
+ * lock is dropped before the copy.
+ */
+struct module_vma {
+	unsigned long start;
+	unsigned long end;
+	unsigned long pgoff;
+	struct file *file;		/* referenced, may be NULL */
+	int clean;			/* see vma_clean() */
+};
+
+/*
+ * Only the modules copied from clean pages of their file are shared. A
+ * writable vma, or one with an anon_vma, may have private pages that
+ * differ from the file: its module stays private to the process.
+ */
+static int vma_clean(struct vm_area_struct *vma)
+{
+	return vma->vm_file && !(vma->vm_flags & VM_WRITE) && !vma->anon_vma;
+}
+
+/* Snapshot the vma of mm at addr, release it with module_vma_put() */
+static int module_vma_get(struct mm_struct *mm, unsigned long addr,
+		struct module_vma *mv)
+{
+	struct vm_area_struct *vma;
+	int err = 0;
 
-	// Get the vma pages
-	npages = vma_pages(mod->elf_vma);
-	pages = kmalloc(sizeof(struct page *) * npages, GFP_KERNEL);
-	if (!pages) {
-		res = -ENOMEM;
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, addr);
+	if (!vma || vma->vm_start > addr) {
+		err = -EINVAL;
 		goto out;
 	}
+	mv->start = vma->vm_start;
+	mv->end = vma->vm_end;
+	mv->pgoff = vma->vm_pgoff;
+	mv->file = vma->vm_file ? get_file(vma->vm_file) : NULL;
+	mv->clean = vma_clean(vma);
+out:
+	up_read(&mm->mmap_sem);
+	return err;
+}
 
-	/*
-	 * FIXME: add missing put_page() and check pinned size
-	 * See example: drivers/infiniband/hw/hfi1/user_pages.c
-	 */
-	res = __get_user_pages_unlocked(task, task->mm, mod->elf_vma->vm_start,
-			npages, 0, 0, pages, FOLL_TOUCH);
-	if (res < 0)
-		goto out_free_pages;
-	npages = res;
+static void module_vma_put(struct module_vma *mv)
+{
+	if (mv->file)
+		fput(mv->file);
+}
 
-	/*
-	 * vmap the pages containing the eh_frame for direct
-	 * access without copy_from_user.
-	 */
-	mod->elf_vmap = vmap(pages, npages, mod->elf_vma->vm_flags, mod->elf_vma->vm_page_prot);
-	dbug_unwind(1, "vmap kernel addr: %p\n", mod->elf_vmap);
+/* Whether the vma of the snapshot is still mapped, and still clean */
+static int module_vma_still_clean(struct mm_struct *mm,
+		struct module_vma *mv)
+{
+	struct vm_area_struct *vma;
+	int clean;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, mv->start);
+	clean = vma && vma->vm_start == mv->start && vma->vm_end == mv->end
+		&& vma->vm_file == mv->file && vma_clean(vma);
+	up_read(&mm->mmap_sem);
+	return clean;
+}
+
+/* Reads the build id of the file, so it can't be called under a lock */
+static void fill_module_key(struct kunwind_module_key *key,
+		struct module_vma *mv, struct load_info *linfo,
+		int compat)
+{
+	int res;
+
+	memset(key, 0, sizeof(*key));
+	if (mv->file) {
+		key->inode = file_inode(mv->file);
+		key->mtime = key->inode->i_mtime;
+		res = file_build_id(mv->file, key->build_id,
+				    sizeof(key->build_id));
+		dbug_unwind(1, "file_build_id %d\n", res);
+		key->build_id_len = res > 0 ? res : 0;
+	}
+	key->pgoff = mv->pgoff;
+	key->size = mv->end - mv->start;
+	key->hdr_offset = linfo->eh_frame_hdr_ubuf - mv->start;
+	key->link_start = linfo->dynamic ? 0 : mv->start;
+	key->compat = compat;
+}
+
+static inline u32 module_key_hash(struct kunwind_module_key *key)
+{
+	return jhash(&key->inode, sizeof(key->inode), 0);
+}
+
+static int module_key_equal(struct kunwind_module_key *a,
+		struct kunwind_module_key *b)
+{
+	return a->inode == b->inode
+		&& a->mtime.tv_sec == b->mtime.tv_sec
+		&& a->mtime.tv_nsec == b->mtime.tv_nsec
+		&& a->pgoff == b->pgoff
+		&& a->size == b->size
+		&& a->hdr_offset == b->hdr_offset
+		&& a->link_start == b->link_start
+		&& a->build_id_len == b->build_id_len
+		&& !memcmp(a->build_id, b->build_id, a->build_id_len)
+		&& a->compat == b->compat;
+}
+
+/* Called with the registry lock held, a retained module stops being one */
+static struct kunwind_module *kunwind_module_find(struct kunwind_module_key *key)
+{
+	struct kunwind_module *mod;
+
+	/* anonymous mappings are never shared */
+	if (!key->inode)
+		return NULL;
+
+	hash_for_each_possible(kunw_registry, mod, hlist,
+			       module_key_hash(key)) {
+		if (!module_key_equal(&mod->key, key))
+			continue;
+		if (!mod->users) {
+			list_del_init(&mod->retained);
+			kunw_nr_retained--;
+			kunwind_stat_inc(KUNWIND_STAT_MODULES_REUSED);
+		}
+		return mod;
+	}
+	return NULL;
+}
+
+/*
+ * Remove the least recently released module from the registry if more
+ * than max are retained. Called with the registry lock held, the caller
+ * unloads the module returned.
+ */
+static struct kunwind_module *kunwind_module_evict(unsigned int max)
+{
+	struct kunwind_module *mod;
+
+	if (kunw_nr_retained <= max)
+		return NULL;
+	mod = list_last_entry(&kunw_retained, struct kunwind_module, retained);
+	list_del_init(&mod->retained);
+	kunw_nr_retained--;
+	hash_del(&mod->hlist);
+	return mod;
+}
+
+/* Copy a section of the module in a kernel buffer */
+static int copy_section(struct section *sect, struct module_vma *mv)
+{
+	if (!sect->size || sect->offset > mv->end - mv->start
+	    || sect->size > mv->end - mv->start - sect->offset)
+		return -EINVAL;
+
+	sect->kbuf = vmalloc(sect->size);
+	if (!sect->kbuf)
+		return -ENOMEM;
 
-	if (!mod->elf_vmap)
-		goto out_put_pages;
+	if (copy_from_user(sect->kbuf, sect->ubuf, sect->size)) {
+		vfree(sect->kbuf);
+		sect->kbuf = NULL;
+		return -EFAULT;
+	}
+	return 0;
+}
 
-	mod->pages = pages;
-	mod->npages = npages;
+/*
+ * linfo must at least have eh_frame_hdr_addr and eh_frame_hdr_len
+ *
+ * Only the eh_frame_hdr and eh_frame sections are copied in the
+ * kernel, the rest of the mapping is never accessed. The vma must be
+ * in the address space of the current task.
+ */
+static int init_kunwind_stp_module(struct load_info *linfo,
+		struct module_vma *mv,
+		struct kunwind_module *mod,
+		int compat)
+{
+	int res;
 
 	/* eh_frame_hdr */
 	mod->ehf_hdr.ubuf = (void *) linfo->eh_frame_hdr_ubuf;
 	mod->ehf_hdr.size = linfo->eh_frame_hdr_size;
-	mod->ehf_hdr.offset = linfo->eh_frame_hdr_ubuf - mod->elf_vma->vm_start;
-	mod->ehf_hdr.kbuf = mod->elf_vmap + mod->ehf_hdr.offset;
+	mod->ehf_hdr.offset = linfo->eh_frame_hdr_ubuf - mv->start;
 	mod->is_dynamic = linfo->dynamic;
+	res = copy_section(&mod->ehf_hdr, mv);
+	if (res)
+		goto out;
 
 	/* eh_frame */
 	if (linfo->eh_frame_addr && linfo->eh_frame_size) {
 		/* the userspace provides eh_frame location */
 		mod->ehf.ubuf = (void *) linfo->eh_frame_addr;
 		mod->ehf.size = linfo->eh_frame_size;
-		mod->ehf.offset = linfo->eh_frame_addr - mod->elf_vma->vm_start;
-		mod->ehf.kbuf = mod->elf_vmap + mod->ehf.offset;
+		mod->ehf.offset = linfo->eh_frame_addr - mv->start;
 	} else {
 		/* find the eh_frame location ourselves */
-		res = eh_frame_from_hdr(mod->elf_vmap, mod->elf_vma->vm_start,
-				mod->elf_vma->vm_end, proc->compat,
+		res = eh_frame_from_hdr(mv->start, mv->end, compat,
 				&mod->ehf_hdr, &mod->ehf);
 
 		dbug_unwind(1, "fill_eh_frame_info %d\n", res);
 		if (res)
-			goto out_vunmap;
+			goto out_free_hdr;
 	}
+	res = copy_section(&mod->ehf, mv);
+	if (res)
+		goto out_free_hdr;
 
-	dbug_unwind(1, "Loaded module from %pD1\n", mod->elf_vma->vm_file);
+	dbug_unwind(1, "Loaded module from %pD1 (hdr %u bytes, eh_frame %u bytes)\n",
+		    mv->file, mod->ehf_hdr.size, mod->ehf.size);
 
-	res = get_user(test, (unsigned long *)linfo->eh_frame_hdr_ubuf);
-	if (res < 0)
-		goto out_vunmap;
-	if (test != *((unsigned long *) mod->ehf_hdr.kbuf)) {
-		WARN_ON_ONCE("Bad eh_frame virtual kernel address.");
-		goto out_vunmap;
+	/* decode the search table once for all the unwinds */
+	mod->unw_table = NULL;
+	res = fde_table_from_hdr(mod, compat);
+	dbug_unwind(1, "fde_table_from_hdr %d\n", res);
+	if (res)
+		goto out_free_ehf;
+
+	res = unw_cache_init(&mod->unw_cache);
+	if (res)
+		goto out_free_fde_table;
+
+	mod->file = mv->file ? get_file(mv->file) : NULL;
+	kunwind_stat_inc(KUNWIND_STAT_MODULE_LOADS);
+	return 0;
+
+out_free_fde_table:
+	vfree(mod->fde_table);
+	mod->fde_table = NULL;
+out_free_ehf:
+	vfree(mod->ehf.kbuf);
+	mod->ehf.kbuf = NULL;
+out_free_hdr:
+	vfree(mod->ehf_hdr.kbuf);
+	mod->ehf_hdr.kbuf = NULL;
+out:
+	dbug_unwind(1, "Failed to load module at virtual address %lx\n", mv->start);
+	return res;
+}
+
+static void close_kunwind_stp_module(struct kunwind_module *mod)
+{
+	unw_cache_clear(&mod->unw_cache);
+	unw_cache_destroy(&mod->unw_cache);
+	vfree(mod->unw_table);
+	mod->unw_table = NULL;
+	vfree(mod->nofp);
+	mod->nofp = NULL;
+	vfree(mod->fde_table);
+	mod->fde_table = NULL;
+	mod->fde_count = 0;
+	vfree(mod->ehf.kbuf);
+	mod->ehf.kbuf = NULL;
+	vfree(mod->ehf_hdr.kbuf);
+	mod->ehf_hdr.kbuf = NULL;
+	if (mod->file)
+		fput(mod->file);
+	mod->file = NULL;
+}
+
+/* Take a reference on the registered module of the key, if any */
+static struct kunwind_module *kunwind_module_lookup(
+		struct kunwind_module_key *key)
+{
+	struct kunwind_module *mod;
+
+	mutex_lock(&kunw_registry_lock);
+	mod = kunwind_module_find(key);
+	if (mod)
+		mod->users++;
+	mutex_unlock(&kunw_registry_lock);
+	return mod;
+}
+
+/*
+ * Get a reference on the module for the vma, loading it if no other
+ * process did yet. The module is loaded without the registry lock: if
+ * another process registered the same one meanwhile, its copy is used
+ * and ours dropped.
+ */
+static struct kunwind_module *kunwind_module_get(struct load_info *linfo,
+		struct mm_struct *mm, struct module_vma *mv, int compat)
+{
+	struct kunwind_module_key key;
+	struct kunwind_module *mod, *found;
+	int shared = mv->clean;
+	int err;
+
+	fill_module_key(&key, mv, linfo, compat);
+
+	if (shared) {
+		mod = kunwind_module_lookup(&key);
+		if (mod) {
+			dbug_unwind(1, "Sharing module from %pD1\n", mod->file);
+			return mod;
+		}
 	}
+
+	mod = kzalloc(sizeof(*mod), GFP_KERNEL);
+	if (!mod)
+		return ERR_PTR(-ENOMEM);
+	err = init_kunwind_stp_module(linfo, mv, mod, compat);
+	if (err) {
+		kfree(mod);
+		return ERR_PTR(err);
+	}
+	mod->key = key;
+	mod->users = 1;
+	INIT_HLIST_NODE(&mod->hlist);
+	INIT_LIST_HEAD(&mod->retained);
+	/* the pages may have been written while they were copied */
+	if (!shared || !module_vma_still_clean(mm, mv))
+		return mod;
+
+	mutex_lock(&kunw_registry_lock);
+	found = kunwind_module_find(&key);
+	if (found)
+		found->users++;
+	else
+		hash_add(kunw_registry, &mod->hlist, module_key_hash(&key));
+	mutex_unlock(&kunw_registry_lock);
+
+	if (found) {
+		close_kunwind_stp_module(mod);
+		kfree(mod);
+		mod = found;
+	}
+	return mod;
+}
+
+/*
+ * The module must not be reachable from the index of any process
+ * anymore, nor used by a concurrent unwind. The last user retains it,
+ * unless it is private, and unloads the older ones over the limit.
+ */
+static void kunwind_module_put(struct kunwind_module *mod)
+{
+	unsigned int max = READ_ONCE(kunw_retained_modules);
+
+	mutex_lock(&kunw_registry_lock);
+	if (--mod->users) {
+		mutex_unlock(&kunw_registry_lock);
+		return;
+	}
+	if (!hlist_unhashed(&mod->hlist) && max) {
+		list_add(&mod->retained, &kunw_retained);
+		kunw_nr_retained++;
+		mutex_unlock(&kunw_registry_lock);
+		kunwind_modules_trim(max);
+		return;
+	}
+	hash_del(&mod->hlist);
+	mutex_unlock(&kunw_registry_lock);
+
+	close_kunwind_stp_module(mod);
+	kfree(mod);
+}
+
+/* Unload the least recently released modules until max are retained */
+static void kunwind_modules_trim(unsigned int max)
+{
+	struct kunwind_module *mod;
+
+	mutex_lock(&kunw_registry_lock);
+	while ((mod = kunwind_module_evict(max))) {
+		/* unloading waits for a grace period */
+		mutex_unlock(&kunw_registry_lock);
+		close_kunwind_stp_module(mod);
+		kfree(mod);
+		mutex_lock(&kunw_registry_lock);
+	}
+	mutex_unlock(&kunw_registry_lock);
+}
+
+/* Unload the retained modules, once no process is registered */
+void kunwind_modules_exit(void)
+{
+	kunwind_modules_trim(0);
+}
+
+/*
+ * Only record the range of the module, it is loaded the first time an
+ * unwind needs it. Called with the mmap_sem of task held for read.
+ */
+static int add_mapping(struct kunwind_proc_modules *mods,
+		struct task_struct *task, struct load_info *linfo)
+{
+	struct vm_area_struct *vma;
+	struct kunwind_mapping *map;
+	char *buf, *path;
+
+	// Get vma for this module
+	// (executable phdr with eh_frame and eh_frame_hdr section)
+	vma = find_vma(task->mm, linfo->eh_frame_hdr_ubuf);
+	if (!vma || vma->vm_start > linfo->eh_frame_hdr_ubuf)
+		return -EINVAL;
+	/* ids are never reused, see KUNWIND_MODOFF_SHIFT */
+	if (mods->next_id >= KUNWIND_MODOFF_MAX_ID)
+		return -ENOSPC;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	map->linfo = *linfo;
+	map->start = vma->vm_start;
+	map->end = vma->vm_end;
+	map->bias = linfo->dynamic ? vma->vm_start : 0;
+	map->id = ++mods->next_id;
+	/*
+	 * The path of the file is complete, the one of the load info may be
+	 * truncated, or missing for the modules found in the address space.
+	 */
+	buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	path = buf ? vma_file_path(vma, buf, PATH_MAX) : NULL;
+	if (path)
+		map->path = kstrdup(path, GFP_KERNEL);
+	else if (map->linfo.path[0])
+		map->path = kstrndup((char *) map->linfo.path,
+				     sizeof(map->linfo.path), GFP_KERNEL);
+	kfree(buf);
+	list_add_tail(&map->list, &mods->mappings);
 	return 0;
+}
+
+/* Load the module of a mapping, with the mappings lock held */
+static int load_mapping(struct kunwind_proc_modules *mods,
+		struct task_struct *task, struct kunwind_mapping *map)
+{
+	struct module_vma mv;
+	struct kunwind_module *mod;
+	int err;
 
+	err = module_vma_get(task->mm, map->linfo.eh_frame_hdr_ubuf, &mv);
+	if (err)
+		return err;
+	/* the range may have been remapped since the registration */
+	if (mv.start != map->start || mv.end != map->end) {
+		err = -EINVAL;
+		goto out;
+	}
 
-out_vunmap:
-	vunmap(mod->elf_vmap);
-out_put_pages:
-	for (i = 0; i < npages; ++i) {
-		put_page(pages[i]);
+	mod = kunwind_module_get(&map->linfo, task->mm, &mv, mods->compat);
+	if (IS_ERR(mod)) {
+		err = PTR_ERR(mod);
+		goto out;
 	}
-out_free_pages:
-	kfree(pages);
+
+	/* unwinds may find the mapping concurrently */
+	smp_store_release(&map->mod, mod);
 out:
-	dbug_unwind(1, "Failed to load module at virtual address %lx\n", mod->elf_vma->vm_start);
-	return res;
+	module_vma_put(&mv);
+	return err;
 }
 
-static void close_kunwind_stp_module(struct kunwind_module *mod)
+static void del_mapping(struct kunwind_mapping *map)
 {
-	int i;
-	dbug_unwind(1, "vunmap kernel addr: %p\n", mod->elf_vmap);
-	vunmap(mod->elf_vmap);
-	mod->elf_vmap = NULL;
-	for (i = 0; i < mod->npages; ++i) {
-		put_page(mod->pages[i]);
+	list_del(&map->list);
+	if (map->mod)
+		kunwind_module_put(map->mod);
+	kfree(map->path);
+	kfree(map);
+}
+
+/* Mapping of the module whose eh_frame_hdr is at addr */
+static struct kunwind_mapping *find_mapping(struct kunwind_proc_modules *mods,
+		unsigned long addr)
+{
+	struct kunwind_mapping *map;
+
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (addr >= map->start && addr < map->end)
+			return map;
+	}
+	return NULL;
+}
+
+static int mod_range_cmp(const void *a, const void *b)
+{
+	const struct kunwind_mod_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/*
+ * Rebuild the sorted array of mapping ranges used by kunw_mod_lookup().
+ * Readers may still use the previous index, it is freed after a grace
+ * period.
+ */
+int kunw_mod_index_build(struct kunwind_proc_modules *mods)
+{
+	struct kunwind_mod_index *index, *old;
+	struct kunwind_mapping *map;
+	unsigned int nr = 0;
+
+	list_for_each_entry(map, &mods->mappings, list)
+		nr++;
+
+	index = kmalloc(sizeof(*index) + nr * sizeof(index->ranges[0]),
+			GFP_KERNEL);
+	if (!index)
+		return -ENOMEM;
+
+	index->nr = 0;
+	list_for_each_entry(map, &mods->mappings, list) {
+		struct kunwind_mod_range *range = &index->ranges[index->nr++];
+
+		range->start = map->start;
+		range->end = map->end;
+		range->map = map;
 	}
-	kfree(mod->pages);
-	mod->npages = 0;
-	mod->pages = NULL;
+	sort(index->ranges, index->nr, sizeof(index->ranges[0]),
+	     mod_range_cmp, NULL);
+
+	old = rcu_dereference_protected(mods->mod_index, 1);
+	rcu_assign_pointer(mods->mod_index, index);
+	if (old)
+		kfree_rcu(old, rcu);
+	return 0;
 }
 
 int init_proc_unwind_info(struct kunwind_proc_modules *mods,
@@ -266,7 +908,9 @@ int init_proc_unwind_info(struct kunwind_proc_modules *mods,
 	if (!mods)
 		return -EINVAL;
 	memset(mods, 0, sizeof(*mods));
-	INIT_LIST_HEAD(&mods->stp_modules);
+	mutex_init(&mods->lock);
+	INIT_LIST_HEAD(&mods->mappings);
+	INIT_LIST_HEAD(&mods->threads);
 	mods->compat = compat;
 
 	return 0;
@@ -274,102 +918,550 @@ int init_proc_unwind_info(struct kunwind_proc_modules *mods,
 
 void release_unwind_info(struct kunwind_proc_modules *mods)
 {
-	struct kunwind_module *mod, *other;
-	list_for_each_entry_safe(mod, other, &mods->stp_modules, list) {
-		close_kunwind_stp_module(mod);
-		list_del(&mod->list);
-		kfree(mod);
-	}
-	unw_cache_clear(mods);
+	struct kunwind_mapping *map, *other;
+	list_for_each_entry_safe(map, other, &mods->mappings, list)
+		del_mapping(map);
+	kfree(rcu_dereference_protected(mods->mod_index, 1));
+	kunwind_ring_free(mods->ring);
+	kunwind_stackmap_free(mods->stackmap);
+	vfree(mods->tails);
 	kfree(mods);
 }
 
-// TODO generalize this function for compat tasks with Elf32 structures
-#define ElfW(smt) Elf64_##smt
+/* Read the i-th program header of either ELF class */
+static void phdr_get(const struct phdr_info *info, unsigned int i,
+		     u32 *type, unsigned long *vaddr, unsigned long *memsz)
+{
+	if (info->elfclass == ELFCLASS32) {
+		const Elf32_Phdr *phdr = (const Elf32_Phdr *) info->phdr + i;
+
+		*type = phdr->p_type;
+		*vaddr = phdr->p_vaddr;
+		*memsz = phdr->p_memsz;
+	} else {
+		const Elf64_Phdr *phdr = (const Elf64_Phdr *) info->phdr + i;
+
+		*type = phdr->p_type;
+		*vaddr = phdr->p_vaddr;
+		*memsz = phdr->p_memsz;
+	}
+}
+
 static int add_module(struct phdr_info *info, struct task_struct *task,
 		      void *data)
 {
 	struct kunwind_proc_modules *mods = data;
 	struct load_info linfo = { 0 };
-	const ElfW(Phdr) *eh_phdr = NULL;
-	bool dynamic = false;
-	ElfW(Phdr) *phdr_arr = info->phdr;
-	int i, err = 0;
-	struct kunwind_module *mod;
+	unsigned long eh_vaddr = 0, eh_memsz = 0, vaddr, memsz;
+	bool eh_found = false, dynamic = false;
+	u32 type;
+	int i;
+
+	/* a compat task only runs objects of its own class */
+	if (info->elfclass != (mods->compat ? ELFCLASS32 : ELFCLASS64))
+		return 0;
 
 	for (i = 0; i < info->phnum; ++i) {
-		if (phdr_arr[i].p_type == PT_GNU_EH_FRAME) {
-			eh_phdr = &phdr_arr[i];
-		} else if (phdr_arr[i].p_type == PT_DYNAMIC) {
+		phdr_get(info, i, &type, &vaddr, &memsz);
+		if (type == PT_GNU_EH_FRAME) {
+			eh_vaddr = vaddr;
+			eh_memsz = memsz;
+			eh_found = true;
+		} else if (type == PT_DYNAMIC) {
 			dynamic = true;
 		}
-		if (eh_phdr && dynamic)
+		if (eh_found && dynamic)
 			break;
 	}
 
-	if (!eh_phdr)
+	if (!eh_found)
 		// No module added but we can still try to unwind
 		return 0;
+	if (find_mapping(mods, info->addr + eh_vaddr))
+		return 0;
 
 	// Fill linfo
 	linfo.obj_addr = info->addr;
-	linfo.eh_frame_hdr_ubuf = info->addr + eh_phdr->p_vaddr;
-	linfo.eh_frame_hdr_size = eh_phdr->p_memsz;
+	linfo.eh_frame_hdr_ubuf = info->addr + eh_vaddr;
+	linfo.eh_frame_hdr_size = eh_memsz;
 	linfo.dynamic = dynamic;
 
-	mod = kmalloc(sizeof(struct kunwind_module), GFP_KERNEL);
-	if (!mod)
+	if (add_mapping(mods, task, &linfo) == -ENOMEM)
 		return -ENOMEM;
-	err = init_kunwind_stp_module(task, &linfo, mod, mods);
-	if (err) {
-		kfree(mod); // Free the module not added to the list
-		return 0;
-	}
-
-	list_add_tail(&(mod->list), &(mods->stp_modules));
+	// Other errors skip the module, but we can still try to unwind
 	return 0;
 }
-#undef ElfW
 
+/*
+ * Add the modules of task that are not known yet. Also called to rescan
+ * the process when it maps new executable code. iterate_phdr() holds
+ * mmap_sem for add_mapping().
+ */
 int init_modules_from_task(struct task_struct *task,
 			   struct kunwind_proc_modules *mods)
 {
-	return iterate_phdr(add_module, task, mods);
+	int err;
+
+	mutex_lock(&mods->lock);
+	err = iterate_phdr(add_module, task, mods);
+	if (!err)
+		err = kunw_mod_index_build(mods);
+	mutex_unlock(&mods->lock);
+	return err;
 }
 
 int init_modules_from_proc_info(struct proc_info *pinfo,
 				struct task_struct *task,
 				struct kunwind_proc_modules *mods)
 {
-	int i, err;
+	struct load_info *linfo;
+	int i, err = 0;
+
+	mutex_lock(&mods->lock);
+	down_read(&task->mm->mmap_sem);
 	for (i = 0; i < pinfo->nr_load_segments; ++i) {
-		struct load_info *linfo = &pinfo->load_segments[i];
-		struct kunwind_module *mod =
-			kmalloc(sizeof(struct kunwind_module),
-				GFP_KERNEL);
-		err = init_kunwind_stp_module(task, linfo, mod, mods);
-		if (err) {
-			kfree(mod); // Free the module not added to
-				    // the list
-			return err;
+		linfo = &pinfo->load_segments[i];
+		if (find_mapping(mods, linfo->eh_frame_hdr_ubuf))
+			continue;
+		err = add_mapping(mods, task, linfo);
+		if (err)
+			break;
+	}
+	up_read(&task->mm->mmap_sem);
+	/* index the modules loaded so far, even on error */
+	if (kunw_mod_index_build(mods))
+		err = -ENOMEM;
+	mutex_unlock(&mods->lock);
+	return err;
+}
+
+/*
+ * Add a single module, e.g. a library loaded by dlopen() after the
+ * registration of the process.
+ */
+int kunwind_module_add(struct kunwind_proc_modules *mods,
+		       struct task_struct *task, struct load_info *linfo)
+{
+	int err;
+
+	mutex_lock(&mods->lock);
+	if (find_mapping(mods, linfo->eh_frame_hdr_ubuf)) {
+		err = -EEXIST;
+		goto out;
+	}
+	down_read(&task->mm->mmap_sem);
+	err = add_mapping(mods, task, linfo);
+	up_read(&task->mm->mmap_sem);
+	if (err)
+		goto out;
+	err = kunw_mod_index_build(mods);
+	if (err)
+		del_mapping(list_last_entry(&mods->mappings,
+					    struct kunwind_mapping, list));
+out:
+	mutex_unlock(&mods->lock);
+	return err;
+}
+
+/*
+ * Remove the mappings overlapping [start, start + len), once no unwind
+ * can use them anymore.
+ */
+int kunwind_module_remove(struct kunwind_proc_modules *mods,
+			  unsigned long start, unsigned long len)
+{
+	struct kunwind_mapping *map, *other;
+	LIST_HEAD(removed);
+	int err;
+
+	mutex_lock(&mods->lock);
+	list_for_each_entry_safe(map, other, &mods->mappings, list) {
+		if (map->start < start + len && map->end > start)
+			list_move_tail(&map->list, &removed);
+	}
+	if (list_empty(&removed)) {
+		mutex_unlock(&mods->lock);
+		return -ENOENT;
+	}
+	err = kunw_mod_index_build(mods);
+	if (err) {
+		list_splice_tail(&removed, &mods->mappings);
+		mutex_unlock(&mods->lock);
+		return err;
+	}
+	if (mods->sigreturn >= start && mods->sigreturn - start < len)
+		WRITE_ONCE(mods->sigreturn, 0);
+	mutex_unlock(&mods->lock);
+
+	/* the unwinds run under rcu_read_lock() */
+	synchronize_rcu();
+	kunwind_tails_reset(mods);
+	list_for_each_entry_safe(map, other, &removed, list)
+		del_mapping(map);
+	return 0;
+}
+
+/*
+ * Describe at most max modules of the process in descs, which must be
+ * zeroed. Returns the number of modules.
+ */
+u32 kunwind_module_table(struct kunwind_proc_modules *mods,
+			 struct kunwind_module_desc *descs, u32 max)
+{
+	struct kunwind_mapping *map;
+	u32 nr = 0;
+
+	mutex_lock(&mods->lock);
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (nr < max) {
+			struct kunwind_module_desc *desc = &descs[nr];
+
+			desc->id = map->id;
+			desc->start = map->start;
+			desc->end = map->end;
+			desc->base = map->linfo.obj_addr;
+			if (map->path)
+				strlcpy((char *) desc->path, map->path,
+					sizeof(desc->path));
 		}
-		list_add_tail(&(mod->list), &(mods->stp_modules));
+		nr++;
 	}
+	mutex_unlock(&mods->lock);
+	return nr;
+}
+
+/*
+ * Replace the pcs of a backtrace by the id of their module and their
+ * offset from its base, see KUNWIND_MODOFF_SHIFT. Doesn't sleep.
+ */
+void kunwind_backtrace_modoff(struct kunwind_proc_modules *mods,
+			      struct kunwind_backtrace *bt)
+{
+	struct kunwind_mod_index *index;
+	struct kunwind_mapping *map;
+	unsigned int i;
+
+	rcu_read_lock();
+	index = rcu_dereference(mods->mod_index);
+	for (i = 0; index && i < bt->nr_entries; i++) {
+		map = kunw_mod_index_find(index, bt->entries[i]);
+		if (map)
+			bt->entries[i] = ((u64) map->id << KUNWIND_MODOFF_SHIFT)
+				| (bt->entries[i] - map->linfo.obj_addr);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Load the modules that unwinds ran into since the last call. A module
+ * that can't be loaded is not tried again. Returns the number of
+ * modules loaded.
+ */
+int kunwind_modules_load(struct task_struct *task,
+			 struct kunwind_proc_modules *mods)
+{
+	struct kunwind_mapping *map;
+	int nr = 0;
+
+	mutex_lock(&mods->lock);
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (map->mod || !test_bit(KUNWIND_MAP_WANTED, &map->flags)
+		    || test_bit(KUNWIND_MAP_FAILED, &map->flags))
+			continue;
+		if (load_mapping(mods, task, map))
+			set_bit(KUNWIND_MAP_FAILED, &map->flags);
+		else
+			nr++;
+	}
+	mutex_unlock(&mods->lock);
+	return nr;
+}
+
+/*
+ * Load all the modules and compile the unwind table of every module
+ * that doesn't have one yet.
+ */
+int compile_unwind_tables(struct task_struct *task,
+			  struct kunwind_proc_modules *mods)
+{
+	struct kunwind_mapping *map;
+	int err = 0;
+
+	mutex_lock(&mods->lock);
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (!map->mod && !test_bit(KUNWIND_MAP_FAILED, &map->flags)
+		    && load_mapping(mods, task, map))
+			set_bit(KUNWIND_MAP_FAILED, &map->flags);
+		if (!map->mod || READ_ONCE(map->mod->unw_table))
+			continue;
+		err = unw_table_compile(map->mod, mods->compat);
+		dbug_unwind(1, "unw_table_compile %d\n", err);
+		if (err)
+			break;
+	}
+	mutex_unlock(&mods->lock);
+	return err;
+}
+
+/* Module of the mapping with that id, loaded, with the mappings lock held */
+static struct kunwind_module *find_module_id(struct kunwind_proc_modules *mods,
+		u32 id)
+{
+	struct kunwind_mapping *map;
+
+	list_for_each_entry(map, &mods->mappings, list) {
+		if (map->id != id)
+			continue;
+		if (!map->mod && !test_bit(KUNWIND_MAP_FAILED, &map->flags)
+		    && load_mapping(mods, current, map))
+			set_bit(KUNWIND_MAP_FAILED, &map->flags);
+		return map->mod ? map->mod : ERR_PTR(-EINVAL);
+	}
+	return ERR_PTR(-ENOENT);
+}
+
+static void table_blob_build_id(struct kunwind_table_blob *blob,
+		struct kunwind_module *mod)
+{
+	memcpy(blob->build_id, mod->key.build_id, sizeof(blob->build_id));
+	blob->build_id_len = mod->key.build_id_len;
+}
+
+/*
+ * Serialize the unwind table of the module blob->id in *table, compiling
+ * it if needed, and set blob->size. With a NULL blob->buf, only the
+ * build id is set.
+ */
+int kunwind_table_export(struct kunwind_proc_modules *mods,
+			 struct kunwind_table_blob *blob, void **table)
+{
+	struct kunwind_module *mod;
+	int err = 0;
+
+	*table = NULL;
+	mutex_lock(&mods->lock);
+	mod = find_module_id(mods, blob->id);
+	if (IS_ERR(mod)) {
+		err = PTR_ERR(mod);
+		goto out;
+	}
+	table_blob_build_id(blob, mod);
+	blob->size = 0;
+	if (!blob->buf)
+		goto out;
+
+	if (!READ_ONCE(mod->unw_table))
+		err = unw_table_compile(mod, mods->compat);
+	if (!err)
+		*table = unw_table_export(mod, mods->compat, &blob->size);
+	if (IS_ERR(*table)) {
+		err = PTR_ERR(*table);
+		*table = NULL;
+	}
+out:
+	mutex_unlock(&mods->lock);
+	return err;
+}
+
+/* Use the table of blob->size bytes for the module blob->id */
+int kunwind_table_import(struct kunwind_proc_modules *mods,
+			 struct kunwind_table_blob *blob, const void *table)
+{
+	struct kunwind_module *mod;
+	int err;
+
+	mutex_lock(&mods->lock);
+	mod = find_module_id(mods, blob->id);
+	if (IS_ERR(mod)) {
+		err = PTR_ERR(mod);
+		goto out;
+	}
+	table_blob_build_id(blob, mod);
+	err = unw_table_import(mod, mods->compat, table, blob->size);
+	dbug_unwind(1, "unw_table_import %d\n", err);
+out:
+	mutex_unlock(&mods->lock);
+	return err;
+}
+
+/*
+ * Preallocated unwind contexts, so that unwinds don't need a large
+ * stack frame nor allocations. A CPU may start an unwind in an
+ * interrupt while another is running, each nesting level has its own
+ * context.
+ */
+enum {
+	KUNW_CTX_TASK,
+	KUNW_CTX_SOFTIRQ,
+	KUNW_CTX_IRQ,
+	KUNW_CTX_NMI,
+	KUNW_CTX_LEVELS,
+};
+
+struct kunwind_cpu_ctx {
+	struct unwind_context ctx[KUNW_CTX_LEVELS];
+	int busy[KUNW_CTX_LEVELS];
+	u64 entries[KUNW_CTX_LEVELS][KUNWIND_MAX_ENTRIES];	/* scratch */
+	unsigned long tail_sp[KUNW_CTX_LEVELS][KUNWIND_MAX_ENTRIES];
+};
+
+static struct kunwind_cpu_ctx __percpu *kunw_cpu_ctx;
+
+int kunwind_contexts_init(void)
+{
+	kunw_cpu_ctx = alloc_percpu(struct kunwind_cpu_ctx);
+	if (!kunw_cpu_ctx)
+		return -ENOMEM;
+	return 0;
+}
+
+void kunwind_contexts_exit(void)
+{
+	free_percpu(kunw_cpu_ctx);
+	kunw_cpu_ctx = NULL;
+}
+
+static inline int kunwind_ctx_level(void)
+{
+	if (in_nmi())
+		return KUNW_CTX_NMI;
+	if (in_irq())
+		return KUNW_CTX_IRQ;
+	if (in_serving_softirq())
+		return KUNW_CTX_SOFTIRQ;
+	return KUNW_CTX_TASK;
+}
+
+/*
+ * Scratch buffer of KUNWIND_MAX_ENTRIES entries for the backtraces
+ * copied to user space or to a ring, one per nesting level. Only valid
+ * with preemption disabled.
+ */
+u64 *kunwind_scratch_entries(void)
+{
+	return this_cpu_ptr(kunw_cpu_ctx)->entries[kunwind_ctx_level()];
+}
+
+/*
+ * Remember the last backtrace of the threads of the process, so that
+ * the next unwinds of a thread stop at the first frame they share with
+ * it. The threads are hashed by pid in a small table, a colliding
+ * thread replaces the previous one.
+ */
+int kunwind_tails_create(struct kunwind_proc_modules *mods)
+{
+	struct kunwind_tail *tails;
+	int i;
+
+	tails = vzalloc(sizeof(*tails) << KUNWIND_TAILS_BITS);
+	if (!tails)
+		return -ENOMEM;
+	for (i = 0; i < (1 << KUNWIND_TAILS_BITS); i++)
+		spin_lock_init(&tails[i].lock);
+
+	if (cmpxchg(&mods->tails, NULL, tails))
+		vfree(tails);
 	return 0;
 }
 
+/* Forget the remembered backtraces, when the mappings change */
+void kunwind_tails_reset(struct kunwind_proc_modules *mods)
+{
+	struct kunwind_tail *tails = smp_load_acquire(&mods->tails);
+	unsigned long flags;
+	int i;
+
+	if (!tails)
+		return;
+	for (i = 0; i < (1 << KUNWIND_TAILS_BITS); i++) {
+		spin_lock_irqsave(&tails[i].lock, flags);
+		tails[i].nr = 0;
+		spin_unlock_irqrestore(&tails[i].lock, flags);
+	}
+}
+
+/*
+ * The tail of a thread is locked for the whole unwind. If it is busy,
+ * e.g. sampled while unwinding itself, the unwind is done in full.
+ */
+static struct kunwind_tail *kunwind_tail_get(struct kunwind_proc_modules *mods,
+		struct task_struct *task, unsigned long *flags)
+{
+	struct kunwind_tail *tails = smp_load_acquire(&mods->tails);
+	struct kunwind_tail *tail;
+
+	if (!tails)
+		return NULL;
+	tail = &tails[hash_32(task->pid, KUNWIND_TAILS_BITS)];
+	if (!spin_trylock_irqsave(&tail->lock, *flags))
+		return NULL;
+	if (tail->pid != task->pid) {
+		tail->pid = task->pid;
+		tail->nr = 0;
+	}
+	return tail;
+}
+
+static void kunwind_tail_put(struct kunwind_tail *tail, unsigned long flags)
+{
+	if (tail)
+		spin_unlock_irqrestore(&tail->lock, flags);
+}
+
+/*
+ * Unwind the user stack of task from a snapshot of its registers. The
+ * stack is read directly from user memory, so the task must share the
+ * address space of current. Doesn't sleep nor allocate, so it can be
+ * called from kprobes, tracepoints, perf overflow handlers and NMIs.
+ */
+int do_task_unwind(struct task_struct *task, struct pt_regs *regs,
+		   struct kunwind_backtrace *bt,
+		   struct kunwind_proc_modules *mods)
+{
+	struct kunwind_cpu_ctx *cpu_ctx;
+	struct unwind_context *context;
+	unsigned long flags;
+	int level, ret;
+
+	if (!task->mm || task->mm != current->mm)
+		return -EINVAL;
+
+	/* sampled regs may be the kernel ones, start from the user regs */
+	if (!regs || !user_mode(regs))
+		regs = task_pt_regs(task);
+
+	level = kunwind_ctx_level();
+	cpu_ctx = get_cpu_ptr(kunw_cpu_ctx);
+	if (cpu_ctx->busy[level]) {
+		/* recursion, e.g. a probe hit by the unwinder itself */
+		ret = -EBUSY;
+		goto out;
+	}
+	cpu_ctx->busy[level] = 1;
+	barrier();
+
+	/* the unwind state is reset for each frame */
+	context = &cpu_ctx->ctx[level];
+	context->last_map = NULL;
+	arch_unw_init_frame_info(&context->info, regs, 0);
+	arch_unw_init_frame_info(&context->stub, regs, 0);
+	context->tail = kunwind_tail_get(mods, task, &flags);
+	context->tail_sp = cpu_ctx->tail_sp[level];
+	/* the mappings may be removed concurrently */
+	rcu_read_lock();
+	ret = unwind_full(context, mods, bt);
+	rcu_read_unlock();
+	kunwind_tail_put(context->tail, flags);
+
+	barrier();
+	cpu_ctx->busy[level] = 0;
+out:
+	put_cpu_ptr(kunw_cpu_ctx);
+	return ret;
+}
+
 int do_current_unwind(struct kunwind_backtrace *bt,
 		      struct kunwind_proc_modules *mods)
 {
-	/*
-	 * FIXME: this structure is too large for the stack,
-	 * replace with kmalloc()
-	 */
-	struct unwind_context context;
-	struct pt_regs *regs = current_pt_regs();
-
-	memset(&context, 0, sizeof(context));
-	arch_unw_init_frame_info(&context.info, regs, 0);
-	arch_unw_init_frame_info(&context.stub, regs, 0);
-	return unwind_full(&context, mods, bt);
+	return do_task_unwind(current, current_pt_regs(), bt, mods);
 }
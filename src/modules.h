@@ -3,13 +3,24 @@
 
 #include <proc_info.h>
 #include <kunwind.h>
+#include <linux/bitops.h>
 #include <linux/hashtable.h>
 #include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
 
 #include "unwind/unwind.h"
 
 #define UNW_CACHE_BITS 10
 
+/*
+ * Entries cover the pc range of a CFI row. They are hashed by the
+ * granule of the pc that missed, so that one entry serves all the call
+ * sites of that row within the granule.
+ */
+#define UNW_CACHE_GRANULE_SHIFT 8
+
 struct unw_cache_key {
         unsigned long pc;
 } __attribute__((__packed__));
@@ -18,37 +29,195 @@ struct unw_cache_entry {
 	struct tdep_frame frame;
         struct hlist_node hlist;
         struct rcu_head rcu;
+	int referenced;			/* CLOCK reference bit */
+};
+
+struct unw_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/*
+ * Per-process cache of unwind rules. Lookups are lockless under RCU,
+ * writers take the lock of the bucket they modify, so that threads
+ * inserting in different buckets don't contend. The number of entries
+ * is bounded by the unw_cache_max_entries module parameter.
+ */
+struct unw_cache {
+	DECLARE_HASHTABLE(table, UNW_CACHE_BITS);
+	spinlock_t locks[1 << UNW_CACHE_BITS];	/* one per bucket */
+	atomic_t nr;
+	atomic_t hand;				/* CLOCK hand */
+	struct unw_cache_stats __percpu *stats;
+};
+
+struct unw_table {
+	unsigned int nr;
+	struct tdep_frame rows[0];	/* sorted by start */
+};
+
+struct unw_pc_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+/*
+ * Functions of a module built with frame pointers that don't set one
+ * up, e.g. assembly or objects linked from elsewhere. Frames in these
+ * are unwound from the CFI.
+ */
+struct unw_nofp {
+	unsigned int nr;
+	struct unw_pc_range ranges[0];	/* sorted by start */
+};
+
+/* Address range of a mapping, kept in a sorted array for lookups */
+struct kunwind_mod_range {
+	unsigned long start;
+	unsigned long end;
+	struct kunwind_mapping *map;
 };
 
+struct kunwind_mod_index {
+	unsigned int nr;
+	struct rcu_head rcu;
+	struct kunwind_mod_range ranges[0];	/* sorted by start */
+};
+
+/* Mapping of the module holding pc, under rcu_read_lock() */
+static inline struct kunwind_mapping *
+kunw_mod_index_find(struct kunwind_mod_index *index, unsigned long pc)
+{
+	const struct kunwind_mod_range *base = index->ranges;
+	unsigned num = index->nr;
+
+	if (!num)
+		return NULL;
+	while (num > 1) {
+		unsigned half = num / 2;
+
+		base = (base[half].start <= pc) ? base + half : base;
+		num -= half;
+	}
+	if (pc >= base->start && pc < base->end)
+		return base->map;
+	return NULL;
+}
+
+struct kunwind_ring;
+struct kunwind_stackmap;
+struct kunwind_tail;
+
 struct kunwind_proc_modules {
-	struct list_head stp_modules;
-	DECLARE_HASHTABLE(unw_cache, UNW_CACHE_BITS);
+	struct mm_struct *mm;		/* registered address space */
+	struct mutex lock;		/* serializes the mappings updates */
+	struct list_head mappings;
+	struct list_head threads;	/* flagged by kunwind, under lock */
+	struct kunwind_mod_index __rcu *mod_index;
+	struct kunwind_ring *ring;	/* set once, may be NULL */
+	struct kunwind_stackmap *stackmap;	/* set once, may be NULL */
+	struct kunwind_tail *tails;	/* set once, may be NULL */
+	int track_mmap;			/* follow the mmap syscalls */
+	int load_queued;		/* a task work will load modules */
+	int profile;			/* records are counted in the stackmap */
+	u32 next_id;			/* last mapping id, under lock */
+	unsigned long sigreturn;	/* rt_sigreturn trampoline, 0 if unseen */
+	int compat;
+};
+
+/* Decoded eh_frame_hdr search table entry */
+struct fde_entry {
+	unsigned long start_pc;		/* module relative initial location */
+	const u32 *fde;			/* FDE in the eh_frame kbuf */
+};
+
+/*
+ * Identity of a loaded module. Processes mapping the same part of the
+ * same file share the module, its tables and its rule cache.
+ */
+struct kunwind_module_key {
+	struct inode *inode;
+	struct timespec mtime;
+	unsigned long pgoff;		/* file offset of the vma, in pages */
+	unsigned long size;		/* vma size */
+	unsigned long hdr_offset;	/* eh_frame_hdr offset in the vma */
+	unsigned long link_start;	/* vma start, if not relocatable */
+	u8 build_id[KUNWIND_BUILD_ID_SIZE];
+	unsigned int build_id_len;	/* 0 if the file has none */
 	int compat;
 };
 
 struct kunwind_module {
-	struct list_head list;
-	struct vm_area_struct *elf_vma;	/* ELF userspace vma */
-	void *elf_vmap;			/* ELF vmap in kernel */
-	struct page **pages;		/* ELF pages for kernel vmap */
-	int npages;
-	struct section ehf_hdr;		/* eh_frame_hdr */
-	struct section ehf;		/* eh_frame */
+	struct hlist_node hlist;	/* in the registry, unless private */
+	unsigned int users;		/* protected by the registry lock */
+	struct list_head retained;	/* unused modules, under the same lock */
+	struct kunwind_module_key key;
+	struct file *file;		/* ELF file, pins the inode of the key */
+	struct section ehf_hdr;		/* eh_frame_hdr, copied */
+	struct section ehf;		/* eh_frame, copied */
+	struct fde_entry *fde_table;	/* sorted by start_pc */
+	unsigned int fde_count;
+	struct unw_table *unw_table;	/* compiled rules, may be NULL */
+	struct unw_nofp *nofp;		/* NULL unless built with frame pointers */
+	struct unw_cache unw_cache;
 	int is_dynamic;
 };
 
-struct unw_cache_entry* unw_cache_find_entry(struct kunwind_proc_modules *mods,
+/* kunwind_mapping flags */
+#define KUNWIND_MAP_WANTED	0	/* an unwind needs the module */
+#define KUNWIND_MAP_FAILED	1	/* the module couldn't be loaded */
+
+/*
+ * A module mapped in a process. The pcs of the module tables are
+ * relative to the bias, which is the vma start of dynamic modules.
+ */
+struct kunwind_mapping {
+	struct list_head list;
+	struct kunwind_module *mod;	/* NULL until loaded */
+	unsigned long start;		/* vma range in the process */
+	unsigned long end;
+	unsigned long bias;
+	unsigned long flags;		/* KUNWIND_MAP_* bits */
+	u32 id;				/* in the module table */
+	char *path;			/* may be NULL */
+	struct load_info linfo;
+};
+
+/*
+ * Called by the unwinds that find the mapping of a module not loaded
+ * yet. They can't load it themselves, -EAGAIN tells the caller to
+ * load the wanted modules with kunwind_modules_load() from a context
+ * that can sleep.
+ */
+static inline int kunwind_mapping_want(struct kunwind_mapping *map)
+{
+	if (test_bit(KUNWIND_MAP_FAILED, &map->flags))
+		return -EINVAL;
+	set_bit(KUNWIND_MAP_WANTED, &map->flags);
+	return -EAGAIN;
+}
+
+int unw_cache_module_init(void);
+void unw_cache_module_exit(void);
+int unw_cache_init(struct unw_cache *cache);
+void unw_cache_destroy(struct unw_cache *cache);
+struct unw_cache_entry* unw_cache_find_entry(struct unw_cache *cache,
 		struct unw_cache_key *key);
-void unw_cache_add_entry(struct kunwind_proc_modules *mods,
-		struct tdep_frame *frame);
-void unw_cache_del_entry(struct kunwind_proc_modules *mods,
+void unw_cache_add_entry(struct unw_cache *cache,
+		struct unw_cache_key *key, struct tdep_frame *frame);
+void unw_cache_del_entry(struct unw_cache *cache,
 		struct unw_cache_key *key);
-void unw_cache_clear(struct kunwind_proc_modules *mods);
-void unw_cache_test(struct kunwind_proc_modules *mods);
-void unw_cache_dump(struct kunwind_proc_modules *mods);
+void unw_cache_clear(struct unw_cache *cache);
+void unw_cache_get_stats(struct kunwind_proc_modules *mods,
+		struct kunwind_cache_stats *stats);
+void unw_cache_test(void);
+void unw_cache_dump(struct unw_cache *cache);
 
 int fill_mod_path(struct kunwind_module *mod);
 
+int kunw_mod_index_build(struct kunwind_proc_modules *mods);
+
 int init_proc_unwind_info(struct kunwind_proc_modules *mods,
 			  int compat);
 
@@ -61,7 +230,69 @@ int init_modules_from_proc_info(struct proc_info *info,
 				struct task_struct *task,
 				struct kunwind_proc_modules *mods);
 
+int kunwind_modules_load(struct task_struct *task,
+			 struct kunwind_proc_modules *mods);
+
+int compile_unwind_tables(struct task_struct *task,
+			  struct kunwind_proc_modules *mods);
+
+int kunwind_table_export(struct kunwind_proc_modules *mods,
+			 struct kunwind_table_blob *blob, void **table);
+
+int kunwind_table_import(struct kunwind_proc_modules *mods,
+			 struct kunwind_table_blob *blob, const void *table);
+
+void kunwind_modules_exit(void);
+
+int kunwind_module_add(struct kunwind_proc_modules *mods,
+		       struct task_struct *task, struct load_info *linfo);
+
+int kunwind_module_remove(struct kunwind_proc_modules *mods,
+			  unsigned long start, unsigned long len);
+
+u32 kunwind_module_table(struct kunwind_proc_modules *mods,
+			 struct kunwind_module_desc *descs, u32 max);
+
+void kunwind_backtrace_modoff(struct kunwind_proc_modules *mods,
+			      struct kunwind_backtrace *bt);
+
+/* Maximum number of entries of the backtraces copied to user space */
+#define KUNWIND_MAX_ENTRIES 128
+#define KUNWIND_MAX_MODULES 4096
+
+/*
+ * Last backtrace of a thread, for incremental unwinds. The sp of each
+ * frame is the CFA of its callee, a frame found again at the same pc and
+ * sp is assumed to have the same callers.
+ */
+struct kunwind_tail {
+	spinlock_t lock;
+	pid_t pid;
+	unsigned int nr;		/* 0 if nothing is remembered */
+	u64 pc[KUNWIND_MAX_ENTRIES];
+	unsigned long sp[KUNWIND_MAX_ENTRIES];
+};
+
+/* Number of threads of a process remembered at a time */
+#define KUNWIND_TAILS_BITS 5
+
+int kunwind_tails_create(struct kunwind_proc_modules *mods);
+void kunwind_tails_reset(struct kunwind_proc_modules *mods);
+
+int kunwind_contexts_init(void);
+void kunwind_contexts_exit(void);
+u64 *kunwind_scratch_entries(void);
+
+int do_task_unwind(struct task_struct *task, struct pt_regs *regs,
+		   struct kunwind_backtrace *bt,
+		   struct kunwind_proc_modules *mods);
+
 int do_current_unwind(struct kunwind_backtrace *bt,
 		      struct kunwind_proc_modules *mods);
 
+int kunwind_unwind_task(struct task_struct *task, struct pt_regs *regs,
+			struct kunwind_backtrace *bt);
+
+int kunwind_record_task(struct task_struct *task, struct pt_regs *regs);
+
 #endif // _MODULES_H_
@@ -0,0 +1,122 @@
+#include <linux/errno.h>
+#include <linux/hardirq.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+#include "debug.h"
+#include "ring.h"
+
+struct kunwind_ring *kunwind_ring_create(struct kunwind_ring_params *params)
+{
+	struct kunwind_ring *ring;
+	unsigned long data_size;
+
+	if (!is_power_of_2(params->nr_pages)
+	    || params->nr_pages > KUNWIND_RING_MAX_PAGES
+	    || params->flags & ~(KUNWIND_RING_SYSCALLS | KUNWIND_RING_STACK_IDS))
+		return ERR_PTR(-EINVAL);
+	data_size = params->nr_pages * PAGE_SIZE;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	/* one page for the header, then the data */
+	ring->size = PAGE_SIZE + data_size;
+	ring->header = vmalloc_user(ring->size);
+	if (!ring->header) {
+		kfree(ring);
+		return ERR_PTR(-ENOMEM);
+	}
+	ring->data = (u8 *) ring->header + PAGE_SIZE;
+	ring->mask = data_size - 1;
+	ring->flags = params->flags;
+	spin_lock_init(&ring->lock);
+
+	ring->header->data_offset = PAGE_SIZE;
+	ring->header->data_size = data_size;
+	return ring;
+}
+
+void kunwind_ring_free(struct kunwind_ring *ring)
+{
+	if (!ring)
+		return;
+	vfree(ring->header);
+	kfree(ring);
+}
+
+int kunwind_ring_mmap(struct kunwind_ring *ring, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != ring->size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->header, 0);
+}
+
+/*
+ * Append a backtrace record. Doesn't sleep, and can be called from any
+ * context. In NMI context the record is dropped if another writer holds
+ * the lock. Returns -ENOSPC if the ring is full. The entries are not
+ * copied for an interned stack, only its id.
+ */
+int kunwind_ring_write(struct kunwind_ring *ring, u32 tid, u32 stack_id,
+		       const u64 *entries, u32 nr_entries)
+{
+	struct kunwind_ring_header *header = ring->header;
+	struct kunwind_record *rec;
+	u32 size, offset, pad;
+	unsigned long flags;
+	u64 head, tail;
+
+	if (stack_id)
+		nr_entries = 0;
+	size = ALIGN(sizeof(*rec) + nr_entries * sizeof(*entries), 8);
+	if (size > ring->mask + 1)
+		return -EINVAL;
+
+	local_irq_save(flags);
+	if (in_nmi()) {
+		if (!spin_trylock(&ring->lock)) {
+			local_irq_restore(flags);
+			return -EBUSY;
+		}
+	} else {
+		spin_lock(&ring->lock);
+	}
+
+	head = ring->head;
+	/* pairs with the consumer releasing the records it read */
+	tail = smp_load_acquire(&header->tail);
+	offset = head & ring->mask;
+	pad = (offset + size > ring->mask + 1) ? ring->mask + 1 - offset : 0;
+	if (head - tail + pad + size > ring->mask + 1) {
+		header->lost++;
+		spin_unlock_irqrestore(&ring->lock, flags);
+		return -ENOSPC;
+	}
+
+	if (pad) {
+		*(u32 *) (ring->data + offset) = KUNWIND_RECORD_PAD | pad;
+		head += pad;
+		offset = 0;
+	}
+
+	rec = (struct kunwind_record *) (ring->data + offset);
+	rec->size = size;
+	rec->tid = tid;
+	rec->time = local_clock();
+	rec->nr_entries = nr_entries;
+	rec->stack_id = stack_id;
+	memcpy(rec->entries, entries, nr_entries * sizeof(*entries));
+
+	ring->head = head + size;
+	/* publish the record */
+	smp_store_release(&header->head, ring->head);
+	spin_unlock_irqrestore(&ring->lock, flags);
+	return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include <kunwind.h>
+
+/* Maximum number of data pages of a ring */
+#define KUNWIND_RING_MAX_PAGES 1024
+
+struct kunwind_ring {
+	struct kunwind_ring_header *header;	/* shared with user space */
+	u8 *data;
+	unsigned long size;			/* of the whole mapping */
+	u64 head;				/* kernel copy, not trusted */
+	u32 mask;
+	u32 flags;
+	spinlock_t lock;			/* serializes writers */
+};
+
+struct kunwind_ring *kunwind_ring_create(struct kunwind_ring_params *params);
+void kunwind_ring_free(struct kunwind_ring *ring);
+int kunwind_ring_mmap(struct kunwind_ring *ring, struct vm_area_struct *vma);
+int kunwind_ring_write(struct kunwind_ring *ring, u32 tid, u32 stack_id,
+		       const u64 *entries, u32 nr_entries);
+
+#endif // _RING_H_
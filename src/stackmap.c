@@ -0,0 +1,164 @@
+#include <linux/errno.h>
+#include <linux/hardirq.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "debug.h"
+#include "stackmap.h"
+
+struct kunwind_stackmap *kunwind_stackmap_create(u32 max_stacks)
+{
+	struct kunwind_stackmap *map;
+
+	if (!max_stacks || max_stacks > KUNWIND_STACKMAP_MAX)
+		return ERR_PTR(-EINVAL);
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+
+	map->stacks = vzalloc(max_stacks * sizeof(*map->stacks));
+	if (!map->stacks) {
+		kfree(map);
+		return ERR_PTR(-ENOMEM);
+	}
+	hash_init(map->table);
+	spin_lock_init(&map->lock);
+	map->max = max_stacks;
+	return map;
+}
+
+/* No lookup may be running */
+void kunwind_stackmap_free(struct kunwind_stackmap *map)
+{
+	u32 i;
+
+	if (!map)
+		return;
+	for (i = 0; i < map->nr; i++)
+		kfree(map->stacks[i]);
+	vfree(map->stacks);
+	kfree(map);
+}
+
+static struct kunwind_stack *__stackmap_find(struct kunwind_stackmap *map,
+		u32 hash, const u64 *entries, u32 nr_entries)
+{
+	struct kunwind_stack *stack;
+
+	hash_for_each_possible_rcu(map->table, stack, hlist, hash) {
+		if (stack->hash == hash && stack->nr_entries == nr_entries
+		    && !memcmp(stack->entries, entries,
+			       nr_entries * sizeof(*entries)))
+			return stack;
+	}
+	return NULL;
+}
+
+/*
+ * Return the id of the backtrace, interning it if it is new. Returns 0
+ * if the map is full, or if the stack is new in NMI context, where
+ * allocating is not allowed. Doesn't sleep.
+ */
+u32 kunwind_stackmap_intern(struct kunwind_stackmap *map,
+			    const u64 *entries, u32 nr_entries)
+{
+	struct kunwind_stack *stack, *found;
+	unsigned long flags;
+	u32 hash, id = 0;
+
+	hash = jhash2((const u32 *) entries,
+		      nr_entries * sizeof(*entries) / sizeof(u32), 0);
+
+	rcu_read_lock();
+	stack = __stackmap_find(map, hash, entries, nr_entries);
+	if (stack)
+		id = stack->id;
+	rcu_read_unlock();
+	if (id || in_nmi() || READ_ONCE(map->nr) >= map->max)
+		return id;
+
+	stack = kmalloc(sizeof(*stack) + nr_entries * sizeof(*entries),
+			GFP_NOWAIT | __GFP_NOWARN);
+	if (!stack)
+		return 0;
+	stack->hash = hash;
+	stack->nr_entries = nr_entries;
+	atomic64_set(&stack->count, 0);
+	memcpy(stack->entries, entries, nr_entries * sizeof(*entries));
+
+	spin_lock_irqsave(&map->lock, flags);
+	if (map->nr >= map->max) {
+		kfree(stack);
+		goto out;
+	}
+	/* re-check, another thread may have added it meanwhile */
+	found = __stackmap_find(map, hash, entries, nr_entries);
+	if (found) {
+		id = found->id;
+		kfree(stack);
+		goto out;
+	}
+	stack->id = id = map->nr + 1;
+	smp_store_release(&map->stacks[map->nr], stack);
+	WRITE_ONCE(map->nr, map->nr + 1);
+	hash_add_rcu(map->table, &stack->hlist, hash);
+out:
+	spin_unlock_irqrestore(&map->lock, flags);
+	return id;
+}
+
+const struct kunwind_stack *kunwind_stackmap_lookup(
+		struct kunwind_stackmap *map, u32 id)
+{
+	if (!id || id > READ_ONCE(map->nr))
+		return NULL;
+	return smp_load_acquire(&map->stacks[id - 1]);
+}
+
+/*
+ * Count one more sample of the backtrace. The samples whose stack can't
+ * be interned are counted as lost. Doesn't sleep.
+ */
+int kunwind_stackmap_count(struct kunwind_stackmap *map,
+			   const u64 *entries, u32 nr_entries)
+{
+	u32 id = kunwind_stackmap_intern(map, entries, nr_entries);
+
+	if (!id) {
+		atomic64_inc(&map->lost);
+		return -ENOSPC;
+	}
+	atomic64_inc(&smp_load_acquire(&map->stacks[id - 1])->count);
+	return 0;
+}
+
+/*
+ * Move the counts of the stacks sampled since the last drain to counts,
+ * at most max of them. The others are left for the next drain.
+ */
+u32 kunwind_stackmap_drain(struct kunwind_stackmap *map,
+			   struct kunwind_stack_count *counts, u32 max)
+{
+	u32 i, n = 0, nr = READ_ONCE(map->nr);
+	struct kunwind_stack *stack;
+	u64 count;
+
+	for (i = 0; i < nr && n < max; i++) {
+		stack = smp_load_acquire(&map->stacks[i]);
+		if (!stack || !atomic64_read(&stack->count))
+			continue;
+		count = atomic64_xchg(&stack->count, 0);
+		if (!count)
+			continue;
+		counts[n].id = stack->id;
+		counts[n].__reserved = 0;
+		counts[n].count = count;
+		n++;
+	}
+	return n;
+}
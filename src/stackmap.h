@@ -0,0 +1,46 @@
+#ifndef _STACKMAP_H_
+#define _STACKMAP_H_
+
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include <kunwind.h>
+
+#define KUNWIND_STACKMAP_BITS 10
+
+struct kunwind_stack {
+	struct hlist_node hlist;
+	u32 hash;
+	u32 id;
+	u32 nr_entries;
+	atomic64_t count;		/* in profile mode, since the last drain */
+	u64 entries[0];
+};
+
+/*
+ * Interned backtraces of a process. Lookups are lockless under RCU,
+ * insertions take the lock. Stacks are only freed with the map.
+ */
+struct kunwind_stackmap {
+	DECLARE_HASHTABLE(table, KUNWIND_STACKMAP_BITS);
+	spinlock_t lock;
+	u32 nr;				/* ids 1 to nr are used */
+	u32 max;
+	struct kunwind_stack **stacks;	/* indexed by id - 1 */
+	atomic64_t lost;		/* counts of stacks not interned */
+};
+
+struct kunwind_stackmap *kunwind_stackmap_create(u32 max_stacks);
+void kunwind_stackmap_free(struct kunwind_stackmap *map);
+u32 kunwind_stackmap_intern(struct kunwind_stackmap *map,
+			    const u64 *entries, u32 nr_entries);
+const struct kunwind_stack *kunwind_stackmap_lookup(
+		struct kunwind_stackmap *map, u32 id);
+int kunwind_stackmap_count(struct kunwind_stackmap *map,
+			   const u64 *entries, u32 nr_entries);
+u32 kunwind_stackmap_drain(struct kunwind_stackmap *map,
+			   struct kunwind_stack_count *counts, u32 max);
+
+#endif // _STACKMAP_H_
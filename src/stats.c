@@ -0,0 +1,126 @@
+#include <linux/cpumask.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "stats.h"
+
+#define STATS_FILENAME "kunwind_stats"
+
+DEFINE_PER_CPU(struct kunwind_stats, kunwind_stats);
+DEFINE_STATIC_KEY_FALSE(kunwind_stats_timing);
+static DEFINE_MUTEX(kunwind_stats_lock);
+
+static const char *const stat_names[KUNWIND_NR_STATS] = {
+	[KUNWIND_STAT_UNWINDS] = "unwinds",
+	[KUNWIND_STAT_FRAMES] = "frames",
+	[KUNWIND_STAT_FP_FRAMES] = "fp_frames",
+	[KUNWIND_STAT_SIGNAL_FRAMES] = "signal_frames",
+	[KUNWIND_STAT_CACHE_HITS] = "cache_hits",
+	[KUNWIND_STAT_CACHE_MISSES] = "cache_misses",
+	[KUNWIND_STAT_TABLE_HITS] = "table_hits",
+	[KUNWIND_STAT_FDE_SEARCHES] = "fde_searches",
+	[KUNWIND_STAT_CFI_RUNS] = "cfi_runs",
+	[KUNWIND_STAT_READ_FAULTS] = "read_faults",
+	[KUNWIND_STAT_END_SPLICED] = "end_spliced",
+	[KUNWIND_STAT_MODULE_LOADS] = "module_loads",
+	[KUNWIND_STAT_MODULES_REUSED] = "modules_reused",
+	[KUNWIND_STAT_END + KUNWIND_BT_COMPLETE] = "end_complete",
+	[KUNWIND_STAT_END + KUNWIND_BT_TRUNCATED] = "end_truncated",
+	[KUNWIND_STAT_END + KUNWIND_BT_NO_MODULE] = "end_no_module",
+	[KUNWIND_STAT_END + KUNWIND_BT_NO_FDE] = "end_no_fde",
+	[KUNWIND_STAT_END + KUNWIND_BT_BAD_CFI] = "end_bad_cfi",
+	[KUNWIND_STAT_END + KUNWIND_BT_FAULT] = "end_fault",
+	[KUNWIND_STAT_END + KUNWIND_BT_NOT_LOADED] = "end_not_loaded",
+};
+
+static const char *const hist_names[KUNWIND_NR_HISTS] = {
+	[KUNWIND_HIST_UNWIND] = "unwind_full_ns",
+	[KUNWIND_HIST_FRAME] = "unwind_frame_ns",
+};
+
+/* Sums of the per-CPU counters, they may be updated meanwhile */
+static int kunwind_stats_show(struct seq_file *m, void *v)
+{
+	struct kunwind_stats *sum;
+	int cpu, i, j;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct kunwind_stats *stats = per_cpu_ptr(&kunwind_stats, cpu);
+
+		for (i = 0; i < KUNWIND_NR_STATS; i++)
+			sum->count[i] += READ_ONCE(stats->count[i]);
+		for (i = 0; i < KUNWIND_NR_HISTS; i++)
+			for (j = 0; j < KUNWIND_HIST_BUCKETS; j++)
+				sum->hist[i][j] += READ_ONCE(stats->hist[i][j]);
+	}
+
+	for (i = 0; i < KUNWIND_NR_STATS; i++)
+		seq_printf(m, "%s %llu\n", stat_names[i], sum->count[i]);
+	seq_printf(m, "timing %d\n",
+		   static_key_enabled(&kunwind_stats_timing));
+	/* one line per non empty bucket: [2^j, 2^(j+1)) ns */
+	for (i = 0; i < KUNWIND_NR_HISTS; i++)
+		for (j = 0; j < KUNWIND_HIST_BUCKETS; j++)
+			if (sum->hist[i][j])
+				seq_printf(m, "%s %llu %llu\n", hist_names[i],
+					   1ULL << j, sum->hist[i][j]);
+	kfree(sum);
+	return 0;
+}
+
+static int kunwind_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kunwind_stats_show, NULL);
+}
+
+/* Writing 1 enables the histograms, 0 disables them */
+static ssize_t kunwind_stats_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	bool enable;
+	int err;
+
+	err = kstrtobool_from_user(ubuf, count, &enable);
+	if (err)
+		return err;
+
+	mutex_lock(&kunwind_stats_lock);
+	if (enable && !static_key_enabled(&kunwind_stats_timing))
+		static_branch_enable(&kunwind_stats_timing);
+	else if (!enable && static_key_enabled(&kunwind_stats_timing))
+		static_branch_disable(&kunwind_stats_timing);
+	mutex_unlock(&kunwind_stats_lock);
+	return count;
+}
+
+static const struct file_operations kunwind_stats_fops = {
+	.open = kunwind_stats_open,
+	.read = seq_read,
+	.write = kunwind_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct proc_dir_entry *stats_entry;
+
+int kunwind_stats_init(void)
+{
+	stats_entry = proc_create(STATS_FILENAME, 0644, NULL,
+				  &kunwind_stats_fops);
+	return stats_entry ? 0 : -ENOMEM;
+}
+
+void kunwind_stats_exit(void)
+{
+	proc_remove(stats_entry);
+	if (static_key_enabled(&kunwind_stats_timing))
+		static_branch_disable(&kunwind_stats_timing);
+}
@@ -0,0 +1,78 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <linux/jump_label.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+
+#include <kunwind.h>
+
+#define KUNWIND_BT_NR_STATUS (KUNWIND_BT_NOT_LOADED + 1)
+
+enum kunwind_stat {
+	KUNWIND_STAT_UNWINDS,
+	KUNWIND_STAT_FRAMES,		/* unwound, the spliced ones excluded */
+	KUNWIND_STAT_FP_FRAMES,		/* from the frame pointer */
+	KUNWIND_STAT_SIGNAL_FRAMES,	/* from the sigcontext of a signal */
+	KUNWIND_STAT_CACHE_HITS,
+	KUNWIND_STAT_CACHE_MISSES,
+	KUNWIND_STAT_TABLE_HITS,	/* compiled table, after a cache miss */
+	KUNWIND_STAT_FDE_SEARCHES,
+	KUNWIND_STAT_CFI_RUNS,		/* CIE and FDE programs interpreted */
+	KUNWIND_STAT_READ_FAULTS,	/* failed reads of the user stack */
+	KUNWIND_STAT_END_SPLICED,	/* joined the last backtrace */
+	KUNWIND_STAT_MODULE_LOADS,	/* eh_frame copied and decoded */
+	KUNWIND_STAT_MODULES_REUSED,	/* retained after their last process */
+	/* why the unwinds stopped, indexed by the KUNWIND_BT_* status */
+	KUNWIND_STAT_END,
+	KUNWIND_NR_STATS = KUNWIND_STAT_END + KUNWIND_BT_NR_STATUS,
+};
+
+enum kunwind_hist {
+	KUNWIND_HIST_UNWIND,		/* unwind_full() */
+	KUNWIND_HIST_FRAME,		/* __unwind_frame() */
+	KUNWIND_NR_HISTS,
+};
+
+/* log2 of the latency in ns */
+#define KUNWIND_HIST_BUCKETS 32
+
+struct kunwind_stats {
+	u64 count[KUNWIND_NR_STATS];
+	u64 hist[KUNWIND_NR_HISTS][KUNWIND_HIST_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct kunwind_stats, kunwind_stats);
+/* the clock is only read once the histograms are enabled */
+DECLARE_STATIC_KEY_FALSE(kunwind_stats_timing);
+
+static inline void kunwind_stat_inc(enum kunwind_stat stat)
+{
+	this_cpu_inc(kunwind_stats.count[stat]);
+}
+
+/* Start of a timed section, 0 when the histograms are disabled */
+static inline u64 kunwind_hist_start(void)
+{
+	if (static_branch_unlikely(&kunwind_stats_timing))
+		return local_clock();
+	return 0;
+}
+
+static inline void kunwind_hist_end(enum kunwind_hist hist, u64 start)
+{
+	unsigned int bucket;
+
+	if (!static_branch_unlikely(&kunwind_stats_timing) || !start)
+		return;
+	bucket = ilog2((local_clock() - start) | 1);
+	bucket = min_t(unsigned int, bucket, KUNWIND_HIST_BUCKETS - 1);
+	this_cpu_inc(kunwind_stats.hist[hist][bucket]);
+}
+
+int kunwind_stats_init(void);
+void kunwind_stats_exit(void);
+
+#endif // _STATS_H_
@@ -19,6 +19,7 @@
 
 #include "modules.h"
 #include "debug.h"
+#include "stats.h"
 #include "unwind/unwind.h"
 
 #ifdef UNWIND_DEBUG
@@ -218,17 +219,25 @@ get_pc(struct unwind_frame_info *info)
 	return UNW_PC(info) - info->call_frame;
 }
 
-static struct kunwind_module
-*kunw_mod_lookup(unsigned long pc, struct kunwind_proc_modules *proc)
+static struct kunwind_mapping
+*kunw_mod_lookup(unsigned long pc, struct kunwind_proc_modules *proc,
+		 struct unwind_context *context)
 {
-	struct kunwind_module *kunw_mod = NULL, *pos;
-	list_for_each_entry(pos, &(proc->stp_modules), list) {
-		if (pc >= pos->elf_vma->vm_start && pc <= pos->elf_vma->vm_end) {
-			kunw_mod = pos;
-			break;
-		}
-	}
-	return kunw_mod;
+	struct kunwind_mod_index *index;
+	struct kunwind_mapping *map = NULL;
+
+	if (context->last_map && pc >= context->last_map->start
+	    && pc < context->last_map->end)
+		return context->last_map;
+
+	rcu_read_lock();
+	index = rcu_dereference(proc->mod_index);
+	if (index)
+		map = kunw_mod_index_find(index, pc);
+	if (map)
+		context->last_map = map;
+	rcu_read_unlock();
+	return map;
 }
 
 /* Whether this is a real CIE. Assumes CIE (length) sane. */
@@ -515,8 +524,16 @@ static void set_expr_rule(uleb128_t reg, enum item_location where,
    512 should be enough for anybody... */
 #define MAX_CFI 512
 
+/*
+ * Called with the rules of each row [start, end) the program moves past,
+ * returns 0 to stop the program.
+ */
+typedef int (*unw_row_fn)(struct unwind_state *state, unsigned long start,
+		unsigned long end, void *data);
+
 static int run_cfi_program(const u8 *start, const u8 *end, unsigned long targetLoc,
-		      signed ptrType, int user, struct unwind_state *state, int compat_task)
+		      signed ptrType, int user, struct unwind_state *state, int compat_task,
+		      unw_row_fn row, void *data)
 {
 	union {
 		const u8 *p8;
@@ -872,6 +889,10 @@ static int run_cfi_program(const u8 *start, const u8 *end, unsigned long targetL
 			result = 0;
 		if (result && targetLoc != 0 && targetLoc < state->loc)
 			return 1;
+		if (result && row && state->loc != state->rowLoc
+		    && !row(state, state->rowLoc, state->loc, data))
+			result = 0;
+		state->rowLoc = state->loc;
 	}
 	return result && ptr.p8 == end;
 }
@@ -924,10 +945,13 @@ static char *_stp_eh_enc_name(signed type)
 
 // If this is an address inside a module, adjust for section relocation
 // and the elfutils base relocation done during loading of the .dwarf_frame
-// in translate.cxx.
+// in translate.cxx. The result is relative to the module: the bias of the
+// mapping is added by the callers that need a process address.
+// The sections are copied in separate kernel buffers, so pcrel values
+// are converted with the section they were read from.
 static unsigned long adjust_start_loc(unsigned long start_loc,
 		unsigned ptr_type, int is_ehframe, int user,
-		struct kunwind_module *kunw_mod)
+		struct kunwind_module *kunw_mod, const struct section *sect)
 {
 	unsigned long new_start_loc = start_loc;
 	unsigned long temp = start_loc;
@@ -936,7 +960,7 @@ static unsigned long adjust_start_loc(unsigned long start_loc,
 	 _stp_module_relocate and/or read_pointer. */
 	dbug_unwind(2, "adjust_start_loc parameters: start_loc=%lx ptr_type=%s file=%pD1 dynamic=%d is_ehframe=%d\n",
 			start_loc, _stp_eh_enc_name(ptr_type),
-			kunw_mod->elf_vma->vm_file, kunw_mod->is_dynamic, is_ehframe);
+			kunw_mod->file, kunw_mod->is_dynamic, is_ehframe);
 
 	if (start_loc == 0 || !is_ehframe) {
 		new_start_loc = 0;
@@ -947,43 +971,40 @@ static unsigned long adjust_start_loc(unsigned long start_loc,
 	 * eh_frame data has been loaded in the kernel.
 	 * Adjust the offset in the case start_loc is pcrel
 	 */
-	dbug_unwind(2, "eh_frame=%lx, eh_frame_offset=%lx\n",
-			(unsigned long) kunw_mod->ehf.kbuf, kunw_mod->ehf.offset);
+	dbug_unwind(2, "section=%lx, section_offset=%lx\n",
+			(unsigned long) sect->kbuf, sect->offset);
 	if ((ptr_type & DW_EH_PE_ADJUST) == DW_EH_PE_pcrel) {
-		temp = new_start_loc - (unsigned long) kunw_mod->ehf.kbuf + kunw_mod->ehf.offset;
+		temp = new_start_loc - (unsigned long) sect->kbuf + sect->offset;
 		dbug_unwind(2, "DW_EH_PE_pcrel  %lx -> %lx\n", new_start_loc, temp);
 		new_start_loc = temp;
 	}
-
-	if (kunw_mod->is_dynamic) {
-		temp = new_start_loc + kunw_mod->elf_vma->vm_start;
-		dbug_unwind(2, "is_dynamic  %lx -> %lx\n", new_start_loc, temp);
-		new_start_loc = temp;
-	}
 out:
 	dbug_unwind(1, "adjust_start_loc: %lx -> %lx\n", start_loc, new_start_loc);
 	return new_start_loc;
 }
 
-/* If we previously created an unwind header, then use it now to binary search */
-/* for the FDE corresponding to pc. */
-static u32 *_stp_search_fde(unsigned long pc, int is_ehframe, int user,
-			    int compat_task, struct kunwind_module *kunw_mod)
+/*
+ * Decode the eh_frame_hdr binary search table once, when the module is
+ * loaded, into a flat array of native (start_pc, fde) pairs. The header is
+ * validated here so that _stp_search_fde() only has to bisect the array.
+ */
+int fde_table_from_hdr(struct kunwind_module *kunw_mod, int compat_task)
 {
+	const int user = 1;
+	const int is_ehframe = 1;
 	const u8 *ptr, *end, *hdr = kunw_mod->ehf_hdr.kbuf;
 	uint32_t hdr_len = kunw_mod->ehf_hdr.size;
-	unsigned long start_loc, start_loc_adj;
-	u32 *fde = NULL;
-	unsigned num, table_size;
+	unsigned long start_loc, start_loc_adj, off, prev = 0;
+	unsigned num, table_size, i;
 	unsigned long eh_hdr_addr = kunw_mod->ehf_hdr.offset;
+	struct fde_entry *table;
+	const u32 *fde;
 
 	if (hdr == NULL || hdr_len < 4 || hdr[0] != 1) {
 		_stp_warn("no or bad debug frame hdr\n");
-		return NULL;
+		return -EINVAL;
 	}
 
-	dbug_unwind(1, "binary search for %lx\n", pc);
-
 	/* table_enc */
 	switch (hdr[3] & DW_EH_PE_FORM) {
 	case DW_EH_PE_absptr:
@@ -1003,19 +1024,18 @@ static u32 *_stp_search_fde(unsigned long pc, int is_ehframe, int user,
 		break;
 	default:
 		_stp_warn("bad unwind table encoding");
-		return NULL;
+		return -EINVAL;
 	}
 	ptr = hdr + 4;
 	end = hdr + hdr_len;
 	{
-		// XXX Can the header validity be checked just once?
 		unsigned long eh = read_ptr_sect(&ptr, end, hdr[1], 0,
 						 eh_hdr_addr, user, compat_task, table_size);
 		if ((hdr[1] & DW_EH_PE_ADJUST) == DW_EH_PE_pcrel)
 			eh = eh - (unsigned long)hdr + eh_hdr_addr;
 		if ((is_ehframe && eh != (unsigned long)kunw_mod->ehf.offset)) {
 			_stp_warn("eh_frame_ptr in eh_frame_hdr 0x%lx not valid; eh_frame_offset = 0x%lx", eh, (unsigned long)kunw_mod->ehf.offset);
-			return NULL;
+			return -EINVAL;
 		}
 	}
 	num = read_ptr_sect(&ptr, end, hdr[2], 0, eh_hdr_addr, user, compat_task, table_size);
@@ -1023,50 +1043,70 @@ static u32 *_stp_search_fde(unsigned long pc, int is_ehframe, int user,
 	    || (end - ptr) % (2 * table_size)) {
 		_stp_warn("unwind Bad num=%d end-ptr=%ld 2*tableSize=%d",
 			    num, (long)(end - ptr), 2 * table_size);
-		return NULL;
+		return -EINVAL;
 	}
 
-	do {
-		const u8 *cur = ptr + (num / 2) * (2 * table_size);
-		start_loc = read_ptr_sect(&cur, cur + table_size, hdr[3], 0,
-					 eh_hdr_addr, user, compat_task, table_size);
+	table = vmalloc(num * sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < num; ++i) {
+		start_loc = read_ptr_sect(&ptr, end, hdr[3], 0,
+					  eh_hdr_addr, user, compat_task, table_size);
 		start_loc_adj = adjust_start_loc(start_loc, hdr[3], is_ehframe,
-						 user, kunw_mod);
-		if (!start_loc_adj) {
+						 user, kunw_mod, &kunw_mod->ehf_hdr);
+		if (!start_loc_adj || start_loc_adj < prev) {
 			_stp_warn("error: bad adjusted_start_loc %lx -> %lx\n", start_loc, start_loc_adj);
-			return NULL;
-		}
-		start_loc = start_loc_adj;
-		if (pc < start_loc)
-			num /= 2;
-		else {
-			ptr = cur - table_size;
-			num = (num + 1) / 2;
+			vfree(table);
+			return -EINVAL;
 		}
-	} while (start_loc && num > 1);
-
-	// FIXME: reorganize this code
-	if (num == 1
-	    && (start_loc = adjust_start_loc(read_ptr_sect(&ptr, ptr + table_size, hdr[3], 0,
-							eh_hdr_addr, user, compat_task, table_size),
-					  hdr[3], is_ehframe, user, kunw_mod)) != 0 && pc >= start_loc) {
-		unsigned long off;
-		off = read_ptr_sect(&ptr, ptr + table_size, hdr[3],
-				    0, eh_hdr_addr, user, compat_task, table_size);
-		dbug_unwind(1, "fde off=%lx\n", off);
+		prev = start_loc_adj;
+
 		/* For real eh_frame_hdr the actual fde address is at the
-		   new eh_frame load address. For our own debug_hdr created
-		   table the fde is an offset into the debug_frame table. */
-		if (is_ehframe)
+		   new eh_frame load address. */
+		off = read_ptr_sect(&ptr, end, hdr[3], 0,
+				    eh_hdr_addr, user, compat_task, table_size);
+		fde = NULL;
+		if (off >= kunw_mod->ehf.offset
+		    && off - kunw_mod->ehf.offset + 2 * sizeof(*fde) <= kunw_mod->ehf.size) {
 			fde = (u32 *) (off - kunw_mod->ehf.offset + kunw_mod->ehf.kbuf);
-		else
-			fde = (u32 *) (kunw_mod->ehf.kbuf + off);
+			if (!check_fde(fde, kunw_mod->ehf.kbuf, kunw_mod->ehf.size, is_ehframe))
+				fde = NULL;
+		}
+
+		table[i].start_pc = start_loc_adj;
+		table[i].fde = fde;
 	}
-	if (!check_fde(fde, kunw_mod->ehf.kbuf, kunw_mod->ehf.size, is_ehframe))
-		fde = NULL;
 
-	dbug_unwind(1, "returning fde=%p start_loc=%lx\n", fde, start_loc);
-	return fde;
+	kunw_mod->fde_table = table;
+	kunw_mod->fde_count = num;
+	dbug_unwind(1, "decoded %u fde table entries\n", num);
+	return 0;
+}
+
+/* Binary search the pre-decoded table for the FDE corresponding to pc. */
+static const u32 *_stp_search_fde(unsigned long pc, struct kunwind_module *kunw_mod)
+{
+	const struct fde_entry *base = kunw_mod->fde_table;
+	unsigned num = kunw_mod->fde_count;
+
+	if (unlikely(!base || !num))
+		return NULL;
+
+	dbug_unwind(1, "binary search for %lx\n", pc);
+
+	/* Keep the loop free of unpredictable branches (cmov friendly). */
+	while (num > 1) {
+		unsigned half = num / 2;
+
+		base = (base[half].start_pc <= pc) ? base + half : base;
+		num -= half;
+	}
+	if (pc < base->start_pc)
+		return NULL;
+
+	dbug_unwind(1, "returning fde=%p start_loc=%lx\n", base->fde, base->start_pc);
+	return base->fde;
 }
 
 /*
@@ -1478,39 +1518,129 @@ void dump_context(struct unwind_context *ctx)
 }
 #endif
 
-static int check_standard_frame(struct unwind_state *state,
-		struct unwind_frame_info *frame, int retAddrReg)
+/* Register and offset of a DW_OP_breg of a cfa expression */
+static int unw_expr_breg(const u8 **pexpr, const u8 *end, int compat_task,
+		int *reg, long *off)
+{
+	const u8 *expr = *pexpr;
+	unsigned long value;
+
+	if (*expr < DW_OP_breg0 || *expr > DW_OP_breg31)
+		return 0;
+	value = *expr++ - DW_OP_breg0;
+	value = compat_task ? COMPAT_REG_MAP(DWARF_REG_MAP(value))
+		: DWARF_REG_MAP(value);
+	if (value >= ARRAY_SIZE(reg_info) || expr >= end)
+		return 0;
+	*reg = value;
+	*off = get_sleb128(&expr, end);
+	*pexpr = expr;
+	return 1;
+}
+
+/*
+ * Recognize the cfa expressions with a closed form, so that their rows
+ * can be cached instead of running compute_expr() at each unwind:
+ *   DW_OP_breg<r> off
+ *   DW_OP_breg<r> off; DW_OP_breg<r2> 0; DW_OP_lit<mask>; DW_OP_and;
+ *   DW_OP_lit<ge>; DW_OP_ge; DW_OP_lit<shift>; DW_OP_shl; DW_OP_plus
+ * The second one is the cfa of the x86 PLT entries, which depends on
+ * whether the pc is past the push of the entry. Returns 0 if the
+ * expression has another form.
+ */
+static int unw_cfa_expr_parse(const u8 *expr, int compat_task,
+		struct tdep_item *cfa, struct tdep_cond *cond)
+{
+	/* DW_OP_lit0 stands for any literal */
+	static const u8 cond_ops[] = {
+		DW_OP_lit0, DW_OP_and, DW_OP_lit0, DW_OP_ge,
+		DW_OP_lit0, DW_OP_shl, DW_OP_plus,
+	};
+	uleb128_t len = get_uleb128(&expr, (const u8 *) -1UL);
+	const u8 *end = expr + len;
+	u8 lit[3];
+	long off;
+	unsigned i;
+
+	memset(cond, 0, sizeof(*cond));
+	if (expr >= end || !unw_expr_breg(&expr, end, compat_task,
+					  &cfa->reg, &cfa->off))
+		return 0;
+	cfa->where = Register;
+	if (expr == end)
+		return 1;
+
+	if (!unw_expr_breg(&expr, end, compat_task, &cond->reg, &off) || off
+	    || end - expr != sizeof(cond_ops))
+		return 0;
+	for (i = 0; i < sizeof(cond_ops); i++) {
+		if (cond_ops[i] != DW_OP_lit0) {
+			if (expr[i] != cond_ops[i])
+				return 0;
+		} else if (expr[i] >= DW_OP_lit0 && expr[i] <= DW_OP_lit31) {
+			lit[i / 2] = expr[i] - DW_OP_lit0;
+		} else {
+			return 0;
+		}
+	}
+	cond->mask = lit[0];
+	cond->ge = lit[1];
+	cond->shift = lit[2];
+	cfa->where = Expr;
+	return 1;
+}
+
+/* The cached rules only keep the registers of the frame record */
+static inline int tdep_reg_kept(int reg)
+{
+	return reg == UNW_PC_IDX || reg == UNW_SP_IDX || reg == UNW_FP_IDX;
+}
+
+/*
+ * A row can be cached when the cfa is an offset of the frame or of the
+ * stack pointer and only them and the return address are saved, the
+ * return address either on the stack or still in its register. A cfa
+ * expression qualifies when it has a closed form, a single DW_OP_breg
+ * or the PLT one, see unw_cfa_expr_parse(), and its condition only
+ * reads a register the cached rules keep.
+ */
+static int check_standard_frame(struct unwind_state *state, int retAddrReg,
+		int compat_task)
 {
 	int res;
-	unsigned long cfa;
-	int rip_where;
-	sleb128_t rip_off;
 	struct unwind_reg_state *rs = &REG_STATE;
+	int ra_where = rs->regs[UNW_RA_IDX].where;
+	int sp_where = rs->regs[UNW_SP_IDX].where;
+	int fp_where = rs->regs[UNW_FP_IDX].where;
+	struct tdep_item cfa = { Register, rs->cfa.reg, rs->cfa.off };
+	struct tdep_cond cond;
+
+	/* an expression without closed form leaves no valid cfa register */
+	if (rs->cfa_is_expr
+	    && (!unw_cfa_expr_parse(rs->cfa_expr, compat_task, &cfa, &cond)
+		|| (cfa.where == Expr && !tdep_reg_kept(cond.reg))))
+		cfa.reg = -1;
 
-	cfa = FRAME_REG(rs->cfa.reg, unsigned long) + rs->cfa.off;
-	rip_where = REG_STATE.regs[UNW_PC_IDX].where;
-	rip_off = REG_STATE.regs[UNW_PC_IDX].state.off;
 	dbug_unwind(3, "cfa_is_expr=%d cfa.reg=%lu (%s) cfa.off=%ld "
-		       "cfa-8=%lx where_is_rip=%s rip_off=%ld rip_save_address=0x%lx\n",
+		       "where_is_ra=%s ra_off=%ld\n",
 			rs->cfa_is_expr, rs->cfa.reg, get_reg_name(rs->cfa.reg),
-			rs->cfa.off, cfa - 8, get_where_name(rip_where),
-			rip_off, cfa + rip_off);
-
-	dbug_unwind(3, "rsp_where=%s rbp_where=%s\n",
-			get_where_name(REG_STATE.regs[RSP].where),
-			get_where_name(REG_STATE.regs[RBP].where));
-
-	// FIXME: should we use COMPAT_REG_MAP here?
-	res = (!rs->cfa_is_expr
-		&& (rs->cfa.reg == RBP || rs->cfa.reg == RSP)
-		&& REG_STATE.regs[UNW_PC_IDX].where == Memory
-		&& REG_STATE.regs[UNW_PC_IDX].state.off == -8
-		&& (REG_STATE.regs[RSP].where == Nowhere
-			|| REG_STATE.regs[RSP].where == Same
-			|| REG_STATE.regs[RSP].where == Memory)
-		&& (REG_STATE.regs[RBP].where == Nowhere
-			|| REG_STATE.regs[RBP].where == Same
-			|| REG_STATE.regs[RBP].where == Memory)
+			rs->cfa.off, get_where_name(ra_where),
+			rs->regs[UNW_RA_IDX].state.off);
+
+	dbug_unwind(3, "sp_where=%s fp_where=%s\n",
+			get_where_name(sp_where), get_where_name(fp_where));
+
+	/* COMPAT_REG_MAP already gave the rows of compat tasks native numbers */
+	res = ((cfa.reg == UNW_FP_IDX || cfa.reg == UNW_SP_IDX)
+		&& retAddrReg == UNW_RA_IDX
+		&& (ra_where == Memory
+			|| (ra_where == Same && UNW_RA_IDX != UNW_PC_IDX))
+		&& ((sp_where == Nowhere && UNW_SP_FROM_CFA)
+			|| sp_where == Same
+			|| sp_where == Memory)
+		&& (fp_where == Nowhere
+			|| fp_where == Same
+			|| fp_where == Memory)
 	);
 
 	dbug_unwind(3, "is_standard_frame=%d\n", res);
@@ -1520,14 +1650,16 @@ static int check_standard_frame(struct unwind_state *state,
 
 void dump_tdep_frame(struct tdep_frame *f)
 {
-	dbug_unwind(3, "pc=0x%lx "
+	dbug_unwind(3, "start=0x%lx end=0x%lx "
 			"cfa.where=%d cfa.reg=%x cfa.off=%ld "
-			"rbp.where=%d rbp.reg=%x rbp.off=%ld "
-			"rsp.where=%d rsp.reg=%x rsp.off=%ld\n",
-			f->pc,
+			"fp.where=%d fp.reg=%x fp.off=%ld "
+			"sp.where=%d sp.reg=%x sp.off=%ld "
+			"ra.where=%d ra.reg=%x ra.off=%ld\n",
+			f->start, f->end,
 			f->cfa.where, f->cfa.reg, f->cfa.off,
-			f->rbp.where, f->rbp.reg, f->rbp.off,
-			f->rsp.where, f->rsp.reg, f->rsp.off);
+			f->fp.where, f->fp.reg, f->fp.off,
+			f->sp.where, f->sp.reg, f->sp.off,
+			f->ra.where, f->ra.reg, f->ra.off);
 }
 
 void save_tdep_frame(struct tdep_item *dst, struct unwind_item *src)
@@ -1537,19 +1669,624 @@ void save_tdep_frame(struct tdep_item *dst, struct unwind_item *src)
 	dst->off = src->state.off;
 }
 
-int restore_reg_from_memory(struct unwind_frame_info *frame, int reg,
+/* Fill the cached rules of a frame that passed check_standard_frame() */
+static void fill_tdep_frame(struct tdep_frame *entry,
+		struct unwind_state *state, unsigned long start,
+		unsigned long end, uleb128_t retAddrReg, int compat_task)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->start = start;
+	entry->end = end;
+	entry->last = (REG_STATE.regs[retAddrReg].where == Nowhere);
+	entry->cfa.where = Register;
+	entry->cfa.reg = REG_STATE.cfa.reg;
+	entry->cfa.off = REG_STATE.cfa.off;
+	if (REG_STATE.cfa_is_expr)
+		unw_cfa_expr_parse(REG_STATE.cfa_expr, compat_task,
+				   &entry->cfa, &entry->cond);
+
+	save_tdep_frame(&entry->fp, &REG_STATE.regs[UNW_FP_IDX]);
+	save_tdep_frame(&entry->sp, &REG_STATE.regs[UNW_SP_IDX]);
+	save_tdep_frame(&entry->ra, &REG_STATE.regs[UNW_RA_IDX]);
+	dump_tdep_frame(entry);
+}
+
+/* Sets all rules to default Same value. */
+static void reset_unwind_state(struct unwind_state *state)
+{
+	unsigned i;
+
+	memset(state, 0, sizeof(*state));
+
+	/* All "fake" dwarf registers should start out Nowhere. */
+	for (i = UNW_NR_REAL_REGS; i < ARRAY_SIZE(REG_STATE.regs); ++i)
+		set_no_state_rule(i, Nowhere, state);
+}
+
+/*
+ * Run the CIE and then the FDE instructions, leaving in REG_STATE the
+ * rules for targetLoc. On return, state->loc is past targetLoc if the
+ * FDE program stopped at the start of the next row. With a targetLoc
+ * of 0, the whole FDE program runs and row gets every row but the last.
+ */
+static int run_cie_fde_programs(struct unwind_state *state,
+		const u8 *cieStart, const u8 *cieEnd,
+		const u8 *fdeStart, const u8 *fdeEnd,
+		unsigned long startLoc, unsigned long endLoc,
+		unsigned long targetLoc, signed ptrType, int user,
+		int compat_task, unw_row_fn row, void *data)
+{
+	state->stackDepth = 0;
+	state->loc = startLoc;
+	memcpy(&REG_STATE.cfa, &badCFA, sizeof(REG_STATE.cfa));
+
+	/* Common Information Entry (CIE) instructions. */
+	dbug_unwind (1, "processCFI for CIE\n");
+	if (!run_cfi_program(cieStart, cieEnd, 0, ptrType, user, state, compat_task,
+			     NULL, NULL))
+		return 0;
+
+	/* Store initial state registers for use with DW_CFA_restore... */
+	memcpy(&state->cie_regs, &REG_STATE.regs, sizeof (REG_STATE.regs));
+
+	/* Process Frame Description Entry (FDE) instructions. */
+	dbug_unwind (1, "processCFI for FDE\n");
+	state->rowLoc = startLoc;
+	if (!run_cfi_program(fdeStart, fdeEnd, targetLoc, ptrType, user, state,
+			     compat_task, row, data)
+	    || state->loc > endLoc)
+		return 0;
+	return 1;
+}
+
+/* End of the row whose rules were computed for targetLoc */
+static inline unsigned long row_end_loc(struct unwind_state *state,
+		unsigned long targetLoc, unsigned long endLoc)
+{
+	return (state->loc > targetLoc && state->loc < endLoc) ?
+		state->loc : endLoc;
+}
+
+/* Rows are added to a compiled unwind table by chunks of that many */
+#define UNW_TABLE_CHUNK 1024
+
+struct unw_table_builder {
+	struct unw_table *table;
+	unsigned int size;
+	struct unw_nofp *nofp;
+	unsigned int nofp_size;
+};
+
+/*
+ * Rule of the body of a function with a frame pointer: push %rbp;
+ * mov %rsp,%rbp. The caller frame is then found from rbp alone.
+ */
+static inline int tdep_frame_is_fp(const struct tdep_frame *frame)
+{
+#ifdef UNW_FP_RECORD
+	return frame->cfa.where == Register
+		&& frame->cfa.reg == UNW_FP_IDX && frame->cfa.off == 16
+		&& frame->fp.where == Memory && frame->fp.off == -16
+		&& frame->ra.where == Memory && frame->ra.off == -8
+		&& frame->sp.where != Memory && !frame->last;
+#else
+	return 0;
+#endif
+}
+
+static int unw_nofp_push(struct unw_table_builder *b, unsigned long start,
+		unsigned long end)
+{
+	struct unw_nofp *nofp = b->nofp;
+
+	if (!nofp || nofp->nr == b->nofp_size) {
+		unsigned int size = b->nofp_size + UNW_TABLE_CHUNK;
+
+		nofp = vmalloc(sizeof(*nofp) + size * sizeof(nofp->ranges[0]));
+		if (!nofp)
+			return -ENOMEM;
+		nofp->nr = 0;
+		if (b->nofp) {
+			memcpy(nofp, b->nofp, sizeof(*nofp)
+			       + b->nofp->nr * sizeof(nofp->ranges[0]));
+			vfree(b->nofp);
+		}
+		b->nofp = nofp;
+		b->nofp_size = size;
+	}
+
+	nofp->ranges[nofp->nr].start = start;
+	nofp->ranges[nofp->nr].end = end;
+	nofp->nr++;
+	return 0;
+}
+
+static int tdep_frame_same_rules(const struct tdep_frame *a,
+		const struct tdep_frame *b)
+{
+	return !memcmp(&a->cfa, &b->cfa,
+		       sizeof(*a) - offsetof(struct tdep_frame, cfa));
+}
+
+static int unw_table_push(struct unw_table_builder *b, struct tdep_frame *frame)
+{
+	struct unw_table *table = b->table;
+	struct tdep_frame *row;
+
+	/* Merge contiguous rows with the same rules */
+	if (table && table->nr) {
+		row = &table->rows[table->nr - 1];
+		if (row->end == frame->start && tdep_frame_same_rules(row, frame)) {
+			row->end = frame->end;
+			return 0;
+		}
+	}
+
+	if (!table || table->nr == b->size) {
+		unsigned int size = b->size + UNW_TABLE_CHUNK;
+
+		table = vmalloc(sizeof(*table) + size * sizeof(table->rows[0]));
+		if (!table)
+			return -ENOMEM;
+		table->nr = 0;
+		if (b->table) {
+			memcpy(table, b->table, sizeof(*table)
+			       + b->table->nr * sizeof(table->rows[0]));
+			vfree(b->table);
+		}
+		b->table = table;
+		b->size = size;
+	}
+
+	table->rows[table->nr++] = *frame;
+	return 0;
+}
+
+/* Rows of the FDE being compiled, see unw_table_row() */
+struct unw_fde_rows {
+	struct unw_table_builder *b;
+	unsigned long endLoc;
+	uleb128_t retAddrReg;
+	int compat_task;
+	int fp;				/* a row sets up a frame pointer */
+	int err;
+};
+
+/* Add a row of the FDE to the table if it has standard rules */
+static int unw_table_row(struct unwind_state *state, unsigned long start,
+		unsigned long end, void *data)
+{
+	struct unw_fde_rows *rows = data;
+	struct tdep_frame entry;
+
+	/* rows past the end of the FDE are invalid, they end the program */
+	if (start >= rows->endLoc)
+		return 0;
+	if (end > rows->endLoc)
+		end = rows->endLoc;
+	if (end <= start
+	    || !check_standard_frame(state, rows->retAddrReg, rows->compat_task))
+		return 1;
+
+	fill_tdep_frame(&entry, state, start, end, rows->retAddrReg,
+			rows->compat_task);
+	rows->fp |= tdep_frame_is_fp(&entry);
+	rows->err = unw_table_push(rows->b, &entry);
+	return !rows->err;
+}
+
+/*
+ * Interpret the CFI of one FDE once, and add the rows that have standard
+ * rules to the compiled table as the program advances. Rows that can't
+ * be expressed are left out, unwinding through them falls back on the
+ * CFI. An invalid program keeps the rows found before the error.
+ */
+static int unw_table_compile_fde(struct unw_table_builder *b,
+		struct kunwind_module *kunw_mod, const u32 *fde,
+		struct unwind_state *state, int compat_task)
+{
+	const int user = 1;
+	const int is_ehframe = 1;
+	const u32 *cie;
+	const u8 *cieStart = NULL, *cieEnd = NULL;
+	const u8 *fdeStart = NULL, *fdeEnd = NULL;
+	unsigned long startLoc = 0, endLoc, locRange = 0;
+	unsigned ptrType = -1, call_frame = 1;
+	uleb128_t retAddrReg = 0, codeAlign;
+	sleb128_t dataAlign;
+	struct unw_fde_rows rows = { .b = b, .compat_task = compat_task };
+
+	cie = cie_for_fde(fde, &kunw_mod->ehf, is_ehframe);
+	if (!cie)
+		return 0;
+
+	if (parse_fde_cie(fde, cie, &ptrType, user,
+			&startLoc, &locRange, &fdeStart, &fdeEnd,
+			&cieStart, &cieEnd, &codeAlign,
+			&dataAlign, &retAddrReg, &call_frame,
+			compat_task) < 0)
+		return 0;
+
+	startLoc = adjust_start_loc(startLoc, ptrType, is_ehframe, user,
+				    kunw_mod, &kunw_mod->ehf);
+	if (!startLoc)
+		return 0;
+	endLoc = startLoc + locRange;
+
+	/*
+	 * The caller pc of a signal frame isn't a return address, the rows
+	 * don't record that so these are left to the CFI, and to the CFI only.
+	 */
+	if (!call_frame)
+		return unw_nofp_push(b, startLoc, endLoc);
+
+	if (retAddrReg >= ARRAY_SIZE(reg_info)
+	    || REG_INVALID(retAddrReg)
+	    || reg_info[retAddrReg].width != sizeof(unsigned long))
+		return 0;
+
+	rows.endLoc = endLoc;
+	rows.retAddrReg = retAddrReg;
+
+	reset_unwind_state(state);
+	state->codeAlign = codeAlign;
+	state->dataAlign = dataAlign;
+	/* the last row ends with the FDE, not with an advance */
+	if (run_cie_fde_programs(state, cieStart, cieEnd, fdeStart, fdeEnd,
+				 startLoc, endLoc, 0, ptrType, user,
+				 compat_task, unw_table_row, &rows))
+		unw_table_row(state, state->loc, endLoc, &rows);
+	if (rows.err)
+		return rows.err;
+
+	if (!rows.fp)
+		return unw_nofp_push(b, startLoc, endLoc);
+	return 0;
+}
+
+/*
+ * Walk every FDE of the module once and compile the rules into a sorted
+ * table of PC ranges, so that the unwind of a PC covered by the table
+ * never has to interpret CFI bytecode.
+ */
+int unw_table_compile(struct kunwind_module *kunw_mod, int compat_task)
+{
+	struct unw_table_builder b = { NULL, 0, NULL, 0 };
+	struct unwind_state *state;
+	unsigned int i;
+	int err = 0;
+
+	if (!kunw_mod->fde_table)
+		return -EINVAL;
+
+	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+
+	for (i = 0; i < kunw_mod->fde_count; ++i) {
+		if (!kunw_mod->fde_table[i].fde)
+			continue;
+		err = unw_table_compile_fde(&b, kunw_mod,
+				kunw_mod->fde_table[i].fde, state, compat_task);
+		if (err)
+			break;
+		/* large modules have tens of thousands of FDEs */
+		cond_resched();
+	}
+	kfree(state);
+
+	if (err) {
+		vfree(b.table);
+		vfree(b.nofp);
+		return err;
+	}
+
+	dbug_unwind(1, "compiled %u unwind table rows for %u fdes, %u without frame pointer\n",
+		    b.table ? b.table->nr : 0, kunw_mod->fde_count,
+		    b.nofp ? b.nofp->nr : 0);
+
+	/*
+	 * The module is considered built with frame pointers when at most
+	 * one function in 16 doesn't set one up. The table is kept even if
+	 * empty, it also tells that the chain can be followed.
+	 */
+	if (compat_task || !kunw_mod->fde_count
+	    || (b.nofp && b.nofp->nr * 16 > kunw_mod->fde_count)) {
+		vfree(b.nofp);
+		b.nofp = NULL;
+	} else if (!b.nofp) {
+		b.nofp = vzalloc(sizeof(*b.nofp));
+	}
+	if (b.nofp && cmpxchg(&kunw_mod->nofp, NULL, b.nofp))
+		vfree(b.nofp);
+	/*
+	 * Publish the table, unwinds may already be running. The module
+	 * is shared, another process may have compiled it meanwhile.
+	 */
+	if (cmpxchg(&kunw_mod->unw_table, NULL, b.table))
+		vfree(b.table);
+	return 0;
+}
+
+static void tdep_rule_export(struct kunwind_table_rule *dst,
+		const struct tdep_item *src)
+{
+	dst->where = src->where;
+	dst->reg = src->reg;
+	dst->off = src->off;
+}
+
+static void tdep_rule_import(struct tdep_item *dst,
+		const struct kunwind_table_rule *src)
+{
+	dst->where = src->where;
+	dst->reg = src->reg;
+	dst->off = src->off;
+}
+
+/*
+ * Serialize the compiled table of a module, see struct
+ * kunwind_table_header. Returns a vmalloc-ed buffer of *size bytes.
+ */
+void *unw_table_export(struct kunwind_module *kunw_mod, int compat_task,
+		u32 *size)
+{
+	const struct unw_table *table = smp_load_acquire(&kunw_mod->unw_table);
+	const struct unw_nofp *nofp = smp_load_acquire(&kunw_mod->nofp);
+	struct kunwind_table_header *hdr;
+	struct kunwind_table_row *rows;
+	struct kunwind_table_range *ranges;
+	unsigned int nr_nofp = nofp ? nofp->nr : 0;
+	unsigned long len;
+	unsigned int i;
+
+	if (!table)
+		return ERR_PTR(-ENOENT);
+	len = sizeof(*hdr) + table->nr * sizeof(*rows)
+		+ nr_nofp * sizeof(*ranges);
+	if (len > U32_MAX)
+		return ERR_PTR(-EFBIG);
+	hdr = vzalloc(len);
+	if (!hdr)
+		return ERR_PTR(-ENOMEM);
+
+	hdr->magic = KUNWIND_TABLE_MAGIC;
+	hdr->version = KUNWIND_TABLE_VERSION;
+	hdr->compat = !!compat_task;
+	hdr->build_id_len = kunw_mod->key.build_id_len;
+	memcpy(hdr->build_id, kunw_mod->key.build_id, kunw_mod->key.build_id_len);
+	hdr->ehf_size = kunw_mod->ehf.size;
+	hdr->nr_rows = table->nr;
+	hdr->nr_nofp = nr_nofp;
+	hdr->flags = nofp ? KUNWIND_TABLE_FP : 0;
+
+	rows = (struct kunwind_table_row *) (hdr + 1);
+	for (i = 0; i < table->nr; i++) {
+		const struct tdep_frame *row = &table->rows[i];
+
+		rows[i].start = row->start;
+		rows[i].end = row->end;
+		tdep_rule_export(&rows[i].cfa, &row->cfa);
+		tdep_rule_export(&rows[i].fp, &row->fp);
+		tdep_rule_export(&rows[i].sp, &row->sp);
+		tdep_rule_export(&rows[i].ra, &row->ra);
+		rows[i].cond_reg = row->cond.reg;
+		rows[i].cond_mask = row->cond.mask;
+		rows[i].cond_ge = row->cond.ge;
+		rows[i].cond_shift = row->cond.shift;
+		rows[i].last = row->last;
+	}
+
+	ranges = (struct kunwind_table_range *) (rows + table->nr);
+	for (i = 0; i < nr_nofp; i++) {
+		ranges[i].start = nofp->ranges[i].start;
+		ranges[i].end = nofp->ranges[i].end;
+	}
+	*size = len;
+	return hdr;
+}
+
+/* Rows loaded from user space get the checks of check_standard_frame() */
+static int unw_table_row_valid(const struct tdep_frame *row,
+		const struct tdep_frame *prev)
+{
+	if (row->start >= row->end || (prev && row->start < prev->end))
+		return 0;
+	if (row->cfa.reg != UNW_FP_IDX && row->cfa.reg != UNW_SP_IDX)
+		return 0;
+	if (row->cfa.where == Expr) {
+		if (!tdep_reg_kept(row->cond.reg)
+		    || row->cond.shift >= BITS_PER_LONG)
+			return 0;
+	} else if (row->cfa.where != Register) {
+		return 0;
+	}
+	return (row->ra.where == Memory
+		|| (row->ra.where == Same && UNW_RA_IDX != UNW_PC_IDX))
+		&& ((row->sp.where == Nowhere && UNW_SP_FROM_CFA)
+		    || row->sp.where == Same || row->sp.where == Memory)
+		&& (row->fp.where == Nowhere || row->fp.where == Same
+		    || row->fp.where == Memory)
+		&& (row->last == 0 || row->last == 1);
+}
+
+/*
+ * Use a table serialized by unw_table_export() instead of compiling it.
+ * The table must come from the same eh_frame, which the build id
+ * identifies, and every row is checked as the unwinds trust them.
+ */
+int unw_table_import(struct kunwind_module *kunw_mod, int compat_task,
+		const void *buf, u32 size)
+{
+	const struct kunwind_table_header *hdr = buf;
+	const struct kunwind_table_row *rows;
+	const struct kunwind_table_range *ranges;
+	struct unw_table *table;
+	struct unw_nofp *nofp = NULL;
+	unsigned int i;
+	int err = -EINVAL;
+
+	if (size < sizeof(*hdr) || hdr->magic != KUNWIND_TABLE_MAGIC
+	    || hdr->version != KUNWIND_TABLE_VERSION)
+		return -EINVAL;
+	if (!kunw_mod->key.build_id_len || hdr->compat != !!compat_task
+	    || hdr->build_id_len != kunw_mod->key.build_id_len
+	    || memcmp(hdr->build_id, kunw_mod->key.build_id, hdr->build_id_len)
+	    || hdr->ehf_size != kunw_mod->ehf.size)
+		return -ESTALE;
+	if (size != sizeof(*hdr) + (u64) hdr->nr_rows * sizeof(*rows)
+		    + (u64) hdr->nr_nofp * sizeof(*ranges)
+	    || (hdr->nr_nofp && !(hdr->flags & KUNWIND_TABLE_FP))
+	    || (compat_task && (hdr->flags & KUNWIND_TABLE_FP)))
+		return -EINVAL;
+	if (smp_load_acquire(&kunw_mod->unw_table))
+		return -EEXIST;
+
+	table = vmalloc(sizeof(*table) + hdr->nr_rows * sizeof(table->rows[0]));
+	if (!table)
+		return -ENOMEM;
+	rows = (const struct kunwind_table_row *) (hdr + 1);
+	for (i = 0; i < hdr->nr_rows; i++) {
+		struct tdep_frame *row = &table->rows[i];
+
+		memset(row, 0, sizeof(*row));
+		row->start = rows[i].start;
+		row->end = rows[i].end;
+		tdep_rule_import(&row->cfa, &rows[i].cfa);
+		tdep_rule_import(&row->fp, &rows[i].fp);
+		tdep_rule_import(&row->sp, &rows[i].sp);
+		tdep_rule_import(&row->ra, &rows[i].ra);
+		row->cond.reg = rows[i].cond_reg;
+		row->cond.mask = rows[i].cond_mask;
+		row->cond.ge = rows[i].cond_ge;
+		row->cond.shift = rows[i].cond_shift;
+		row->last = rows[i].last;
+		if (!unw_table_row_valid(row, i ? row - 1 : NULL))
+			goto out_free;
+	}
+	table->nr = hdr->nr_rows;
+
+	if (hdr->flags & KUNWIND_TABLE_FP) {
+		err = -ENOMEM;
+		nofp = vmalloc(sizeof(*nofp)
+			       + hdr->nr_nofp * sizeof(nofp->ranges[0]));
+		if (!nofp)
+			goto out_free;
+		err = -EINVAL;
+		ranges = (const struct kunwind_table_range *) (rows + hdr->nr_rows);
+		for (i = 0; i < hdr->nr_nofp; i++) {
+			nofp->ranges[i].start = ranges[i].start;
+			nofp->ranges[i].end = ranges[i].end;
+			if (nofp->ranges[i].start >= nofp->ranges[i].end
+			    || (i && nofp->ranges[i].start
+				< nofp->ranges[i - 1].end))
+				goto out_free;
+		}
+		nofp->nr = hdr->nr_nofp;
+	}
+
+	dbug_unwind(1, "imported %u unwind table rows, %u without frame pointer\n",
+		    table->nr, nofp ? nofp->nr : 0);
+
+	/* same publication order as unw_table_compile() */
+	if (nofp && cmpxchg(&kunw_mod->nofp, NULL, nofp))
+		vfree(nofp);
+	if (cmpxchg(&kunw_mod->unw_table, NULL, table)) {
+		vfree(table);
+		return -EEXIST;
+	}
+	return 0;
+
+out_free:
+	vfree(nofp);
+	vfree(table);
+	return err;
+}
+
+static const struct tdep_frame *unw_table_search(
+		struct kunwind_module *kunw_mod, unsigned long pc)
+{
+	const struct unw_table *table = smp_load_acquire(&kunw_mod->unw_table);
+	const struct tdep_frame *base;
+	unsigned num;
+
+	if (!table || !table->nr)
+		return NULL;
+
+	base = table->rows;
+	num = table->nr;
+	while (num > 1) {
+		unsigned half = num / 2;
+
+		base = (base[half].start <= pc) ? base + half : base;
+		num -= half;
+	}
+	if (pc < base->start || pc >= base->end)
+		return NULL;
+	return base;
+}
+
+/*
+ * Read size bytes of the user stack at addr. The frames are walked
+ * towards the higher addresses, so a miss copies the window upwards
+ * from addr in one go instead of faulting in each saved register.
+ */
+static int unw_stack_read(struct unw_stack_window *win, unsigned long addr,
+		void *val, unsigned long size)
+{
+	unsigned long len = UNW_STACK_WINDOW;
+	unsigned long left;
+
+	if (addr >= win->start && addr - win->start + size <= win->len)
+		goto hit;
+
+	if (!access_ok(VERIFY_READ, (void __user *) addr, len))
+		len = size;
+	if (!access_ok(VERIFY_READ, (void __user *) addr, len))
+		goto fault;
+
+	pagefault_disable();
+	left = __copy_from_user_inatomic(win->buf, (void __user *) addr, len);
+	pagefault_enable();
+	/* the stack may end before the window, keep what was copied */
+	if (len - left < size)
+		goto fault;
+	win->start = addr;
+	win->len = len - left;
+
+hit:
+	memcpy(val, (u8 *) win->buf + (addr - win->start), size);
+	return 0;
+
+fault:
+	win->len = 0;
+	kunwind_stat_inc(KUNWIND_STAT_READ_FAULTS);
+	return -EFAULT;
+}
+
+int restore_reg_from_memory(struct unwind_context *context, int reg,
 		unsigned long addr, int compat, int user)
 {
+	struct unwind_frame_info *frame = &context->info;
 	unsigned long value = 0;
+	u32 value32;
 	mm_segment_t seg = user ? USER_DS : KERNEL_DS;
 
+	if (user && compat) {
+		/* 32-on-64 bit unwinding, the stack slots are 4 bytes */
+		if (unw_stack_read(&context->win, addr, &value32, sizeof(value32)))
+			goto copy_failed;
+		value = value32;
+	} else if (user) {
+		if (unw_stack_read(&context->win, addr, &value, sizeof(value)))
+			goto copy_failed;
+	} else if (_stp_read_address(value, (unsigned long *)addr, seg)) {
+		goto copy_failed;
+	}
 	/*
 	 * We only want the lower half of the address defined, however
 	 * _stp_read_address will sometimes return garbage in the top half.
-	 * for 32-on-64 bit unwinding we need to ensure this is 0xFFFFFFFF
 	 */
-	if (_stp_read_address(value, (unsigned long *)addr, seg))
-		goto copy_failed;
 	if (compat)
 		value &= 0xFFFFFFFF;
 	FRAME_REG(reg, unsigned long) = value;
@@ -1557,41 +2294,55 @@ int restore_reg_from_memory(struct unwind_frame_info *frame, int reg,
 	return 0;
 
 copy_failed:
-	_stp_warn("_stp_read_address failed to access memory location %lx\n", addr);
+	_stp_warn("failed to access memory location %lx\n", addr);
+	context->status = KUNWIND_BT_FAULT;
 	return -1;
 }
 
-int apply_tdep_state(struct unwind_frame_info *frame, struct tdep_frame *entry,
+int apply_tdep_state(struct unwind_context *context, const struct tdep_frame *entry,
 		int compat, int user)
 {
+	struct unwind_frame_info *frame = &context->info;
 	unsigned long addr;
 	unsigned long cfa = FRAME_REG(entry->cfa.reg, unsigned long) + entry->cfa.off;
 
-	/* Restore rbp */
-	dbug_unwind(3, "restore rbp\n");
-	if (entry->rbp.where == Memory) {
-		addr = cfa + entry->rbp.off;
-		if (restore_reg_from_memory(frame, RBP, addr, compat, user))
+	/* closed form of a cfa expression, see unw_cfa_expr_parse() */
+	if (entry->cfa.where == Expr)
+		cfa += ((FRAME_REG(entry->cond.reg, unsigned long)
+			 & entry->cond.mask) >= entry->cond.ge)
+			<< entry->cond.shift;
+
+	/* Restore the frame pointer */
+	dbug_unwind(3, "restore fp\n");
+	if (entry->fp.where == Memory) {
+		addr = cfa + entry->fp.off;
+		if (restore_reg_from_memory(context, UNW_FP_IDX, addr, compat, user))
 			goto err;
 	}
 
-	/* Restore rsp */
-	dbug_unwind(3, "restore rsp\n");
-	if (entry->rsp.where == Memory) {
-		addr = cfa + entry->rsp.off;
-		if (restore_reg_from_memory(frame, RSP, addr, compat, user))
+	/* Restore the return address, Same leaves it in its register */
+	dbug_unwind(3, "restore ra\n");
+	if (entry->ra.where == Memory) {
+		addr = cfa + entry->ra.off;
+		if (restore_reg_from_memory(context, UNW_RA_IDX, addr, compat, user))
 			goto err;
-	} else {
+	}
+
+	/* Restore the stack pointer */
+	dbug_unwind(3, "restore sp\n");
+	if (entry->sp.where == Memory) {
+		addr = cfa + entry->sp.off;
+		if (restore_reg_from_memory(context, UNW_SP_IDX, addr, compat, user))
+			goto err;
+	} else if (UNW_SP_FROM_CFA) {
 		FRAME_REG(UNW_SP_IDX, unsigned long) = cfa;
 	}
 
-	/* Restore the instruction pointer */
-	dbug_unwind(3, "restore rip\n");
-	addr = cfa - 8; // address on the stack where the return address is saved
-	if (restore_reg_from_memory(frame, UNW_PC_IDX, addr, compat, user))
-		goto err;
+#if (UNW_PC_FROM_RA == 1)
+	UNW_PC(frame) = FRAME_REG(UNW_RA_IDX, unsigned long);
+#endif
 
-	dbug_unwind(3, "restored rip=%lx rbp=%lx rsp=%lx\n",
+	dbug_unwind(3, "restored pc=%lx fp=%lx sp=%lx\n",
 			UNW_PC(frame), UNW_BP(frame), UNW_SP(frame));
 
 	return 0;
@@ -1607,8 +2358,7 @@ err:
  */
 static int
 __unwind_frame(struct unwind_context *context,
-	       struct kunwind_proc_modules *mods,
-	       struct kunwind_module *kunw_mod,
+	       struct kunwind_mapping *map,
 	       int compat_task)
 {
 	uint32_t table_size;
@@ -1622,7 +2372,9 @@ __unwind_frame(struct unwind_context *context,
 	const u8 *fdeStart = NULL, *fdeEnd = NULL;
 	struct unwind_frame_info *frame = &context->info;
 	struct unwind_frame_info *stub = &context->stub;
-	unsigned long pc = UNW_PC(frame) - frame->call_frame;
+	struct kunwind_module *kunw_mod = map->mod;
+	/* the tables and the cache are indexed by module relative pcs */
+	unsigned long pc = UNW_PC(frame) - frame->call_frame - map->bias;
 	unsigned long startLoc = 0, endLoc = 0, locRange = 0, cfa;
 	unsigned i;
 	signed ptrType = -1, call_frame = 1;
@@ -1630,6 +2382,7 @@ __unwind_frame(struct unwind_context *context,
 	struct unwind_state *state = &context->state;
 	struct unw_cache_entry *entry;
 	struct unw_cache_key key;
+	const struct tdep_frame *row;
 	unsigned long addr;
 	unsigned long val;
 	unsigned long frame_size;
@@ -1640,46 +2393,60 @@ __unwind_frame(struct unwind_context *context,
 	if (unlikely(ehf->size == 0)) {
 		// Don't _stp_warn about this, debug_frame and/or eh_frame
 		// might actually not be there.
-		dbug_unwind(1, "file %pD1: no unwind frame data\n", kunw_mod->elf_vma->vm_file);
+		dbug_unwind(1, "file %pD1: no unwind frame data\n", kunw_mod->file);
 		goto err;
 	}
 	if (unlikely(ehf->size & (sizeof(*fde) - 1))) {
-		_stp_warn("file %pD1: frame_len=%d", kunw_mod->elf_vma->vm_file, table_size);
+		_stp_warn("file %pD1: frame_len=%d", kunw_mod->file, table_size);
 		goto err;
 	}
 
 	/* fast path FIXME: remove code duplication */
 	key.pc = pc;
-	entry = unw_cache_find_entry(mods, &key);
+	entry = unw_cache_find_entry(&kunw_mod->unw_cache, &key);
 	if (entry) {
-		if (apply_tdep_state(frame, &entry->frame, compat_task, user))
+		kunwind_stat_inc(KUNWIND_STAT_CACHE_HITS);
+		if (apply_tdep_state(context, &entry->frame, compat_task, user))
 			goto err;
 		if (entry->frame.last)
 			goto bottom;
+		/* only call frames are cached, the caller pc is a return address */
+		frame->call_frame = 1;
 		return 0;
 	}
 
-	/* Sets all rules to default Same value. */
-	memset(state, 0, sizeof(*state));
+	kunwind_stat_inc(KUNWIND_STAT_CACHE_MISSES);
 
-	/* All "fake" dwarf registers should start out Nowhere. */
-	for (i = UNW_NR_REAL_REGS; i < ARRAY_SIZE(REG_STATE.regs); ++i)
-		set_no_state_rule(i, Nowhere, state);
+	/* slow path from the compiled table, no CFI interpretation */
+	row = unw_table_search(kunw_mod, pc);
+	if (row) {
+		kunwind_stat_inc(KUNWIND_STAT_TABLE_HITS);
+		if (apply_tdep_state(context, row, compat_task, user))
+			goto err;
+		if (row->last)
+			goto bottom;
+		frame->call_frame = 1;
+		return 0;
+	}
+
+	reset_unwind_state(state);
 
 	/* DEBUG */
 	dbug_unwind(3, "UNWIND step 1\n");
 	dump_context(context);
 
-	fde = _stp_search_fde(pc, is_ehframe, user, compat_task, kunw_mod);
+	kunwind_stat_inc(KUNWIND_STAT_FDE_SEARCHES);
+	fde = _stp_search_fde(pc, kunw_mod);
 	if (!fde) {
 		_stp_warn("fde not found or invalid\n");
+		context->status = KUNWIND_BT_NO_FDE;
 		goto err;
 	}
-	dbug_unwind(1, "file %pD1: fde=%lx\n", kunw_mod->elf_vma->vm_file, (unsigned long) fde);
+	dbug_unwind(1, "file %pD1: fde=%lx\n", kunw_mod->file, (unsigned long) fde);
 
 	/* found the fde, now set startLoc and endLoc */
 	cie = cie_for_fde(fde, ehf, is_ehframe);
-	dbug_unwind(1, "%pD1: cie=%lx\n", kunw_mod->elf_vma->vm_file, (unsigned long) cie);
+	dbug_unwind(1, "%pD1: cie=%lx\n", kunw_mod->file, (unsigned long) cie);
 	if (unlikely(cie == NULL)) {
 		_stp_warn("fde found in header, but cie is bad!\n");
 		goto err;
@@ -1695,7 +2462,8 @@ __unwind_frame(struct unwind_context *context,
 		goto err;
 	}
 
-	startLoc = adjust_start_loc(startLoc, ptrType, is_ehframe, user, kunw_mod);
+	startLoc = adjust_start_loc(startLoc, ptrType, is_ehframe, user,
+				    kunw_mod, &kunw_mod->ehf);
 	if (!startLoc) {
 		_stp_warn("error: bad adjust_start_loc: %lx", startLoc);
 		goto err;
@@ -1723,40 +2491,22 @@ __unwind_frame(struct unwind_context *context,
 	}
 
 	frame->call_frame = call_frame;
-	state->stackDepth = 0;
-	state->loc = startLoc;
-	memcpy(&REG_STATE.cfa, &badCFA, sizeof(REG_STATE.cfa));
-
-	/* Common Information Entry (CIE) instructions. */
-	dbug_unwind (1, "processCFI for CIE\n");
-	if (!run_cfi_program(cieStart, cieEnd, 0, ptrType, user, state, compat_task))
-		goto err;
-
-	/* Store initial state registers for use with DW_CFA_restore... */
-	memcpy(&state->cie_regs, &REG_STATE.regs, sizeof (REG_STATE.regs));
-
-	/* Process Frame Description Entry (FDE) instructions. */
-	dbug_unwind (1, "processCFI for FDE\n");
-	if (!run_cfi_program(fdeStart, fdeEnd, pc, ptrType, user, state, compat_task)
-	    || state->loc > endLoc)
+	kunwind_stat_inc(KUNWIND_STAT_CFI_RUNS);
+	if (!run_cie_fde_programs(state, cieStart, cieEnd, fdeStart, fdeEnd,
+			startLoc, endLoc, pc, ptrType, user, compat_task,
+			NULL, NULL))
 		goto err;
 
-	ret = check_standard_frame(state, frame, retAddrReg);
-	if (ret) {
+	/* signal frames stay on the slow path, their call_frame isn't cached */
+	ret = check_standard_frame(state, retAddrReg, compat_task);
+	if (ret && call_frame) {
 		struct tdep_frame entry;
-		memset(&entry, 0, sizeof(entry));
-		entry.pc = pc;
-		entry.last = (REG_STATE.regs[retAddrReg].where == Nowhere);
-		entry.cfa.where = Register;
-		entry.cfa.reg = REG_STATE.cfa.reg;
-		entry.cfa.off = REG_STATE.cfa.off;
-
-		save_tdep_frame(&entry.rbp, &REG_STATE.regs[RBP]);
-		save_tdep_frame(&entry.rsp, &REG_STATE.regs[RSP]);
-		dump_tdep_frame(&entry);
-
-		unw_cache_add_entry(mods, &entry);
-		if (apply_tdep_state(frame, &entry, compat_task, user))
+
+		fill_tdep_frame(&entry, state, state->rowLoc,
+				row_end_loc(state, pc, endLoc), retAddrReg,
+				compat_task);
+		unw_cache_add_entry(&kunw_mod->unw_cache, &key, &entry);
+		if (apply_tdep_state(context, &entry, compat_task, user))
 			goto slow_path;
 		if (entry.last)
 			goto bottom;
@@ -1794,12 +2544,12 @@ slow_path:
 	frame_size = abs(cfa - UNW_SP(frame));
 	dbug_unwind(1, "recovered cfa=%lx, rsp=%lx (frame size=%lu)\n", cfa, UNW_SP(frame), frame_size);
 
-	dbug_unwind(1, "check RSP invalid=%d UNW_RSP=%lx RSP=%llx where=%d (%s)\n",
-			REG_INVALID(RSP),
+	dbug_unwind(1, "check SP invalid=%d UNW_SP=%lx SP=%llx where=%d (%s)\n",
+			REG_INVALID(UNW_SP_IDX),
 			UNW_SP(frame),
-			FRAME_REG(RSP, const u64),
-			REG_STATE.regs[RSP].where,
-			get_where_name(REG_STATE.regs[RSP].where));
+			FRAME_REG(UNW_SP_IDX, const u64),
+			REG_STATE.regs[UNW_SP_IDX].where,
+			get_where_name(REG_STATE.regs[UNW_SP_IDX].where));
 
 	dbug_unwind(1, "restore register from frame\n");
 	for (i = 0; i < ARRAY_SIZE(REG_STATE.regs); ++i) {
@@ -1898,7 +2648,7 @@ slow_path:
 			if (compute_expr(REG_STATE.regs[i].state.expr, frame, &addr, user, compat_task))
 				goto err;
 			addr = cfa + REG_STATE.regs[i].state.off;
-			restore_reg_from_memory(frame, i, addr, compat_task, user);
+			restore_reg_from_memory(context, i, addr, compat_task, user);
 			break;
 		case ValExpr:
 			if (compute_expr(REG_STATE.regs[i].state.expr, frame, &addr, user, compat_task))
@@ -1916,7 +2666,7 @@ slow_path:
 		case Memory:
 			addr = cfa + REG_STATE.regs[i].state.off;
 			dbug_unwind(3, "restore from memory: cfa=%lx off=%ld addr=%lx\n", cfa, REG_STATE.regs[i].state.off, addr);
-			restore_reg_from_memory(frame, i, addr, compat_task, user);
+			restore_reg_from_memory(context, i, addr, compat_task, user);
 			break;
 		}
 	}
@@ -1954,50 +2704,245 @@ bottom:
 #undef FRAME_REG
 }
 
+static int unw_nofp_search(const struct unw_nofp *nofp, unsigned long pc)
+{
+	const struct unw_pc_range *base = nofp->ranges;
+	unsigned num = nofp->nr;
+
+	if (!num)
+		return 0;
+	while (num > 1) {
+		unsigned half = num / 2;
+
+		base = (base[half].start <= pc) ? base + half : base;
+		num -= half;
+	}
+	return pc >= base->start && pc < base->end;
+}
+
+/*
+ * Frame pointer fast path, for a caller frame in a module built with
+ * frame pointers: the saved rbp and the return address are read from
+ * the stack window at rbp. Returns 1 when the frame must be unwound from
+ * the CFI instead.
+ */
+static int unwind_frame_fp(struct unwind_context *context,
+		struct kunwind_mapping *map)
+{
+	struct unwind_frame_info *frame = &context->info;
+	const struct unw_nofp *nofp = smp_load_acquire(&map->mod->nofp);
+	unsigned long bp = UNW_BP(frame);
+	unsigned long buf[2];
+
+	if (!nofp || !frame->call_frame)
+		return 1;
+	if (unw_nofp_search(nofp, UNW_PC(frame) - 1 - map->bias))
+		return 1;
+	/* the frame of the caller is above the current one */
+	if (bp < UNW_SP(frame) || (bp & (sizeof(long) - 1)))
+		return 1;
+	if (unw_stack_read(&context->win, bp, buf, sizeof(buf)))
+		return 1;
+
+	UNW_BP(frame) = buf[0];
+	UNW_PC(frame) = buf[1];
+	UNW_SP(frame) = bp + sizeof(buf);
+	frame->call_frame = 1;
+	dbug_unwind(3, "fp: rip=%lx rbp=%lx rsp=%lx\n",
+		    UNW_PC(frame), UNW_BP(frame), UNW_SP(frame));
+	return 0;
+}
+
+#ifdef UNW_SIGRETURN_CODE
+static const u8 unw_sigreturn_code[] = UNW_SIGRETURN_CODE;
+
+/* Whether the code at pc is the rt_sigreturn trampoline */
+static int unw_is_sigreturn(unsigned long pc)
+{
+	u8 code[sizeof(unw_sigreturn_code)];
+	unsigned long left;
+
+	if (!access_ok(VERIFY_READ, (void __user *) pc, sizeof(code)))
+		return 0;
+	pagefault_disable();
+	left = __copy_from_user_inatomic(code, (void __user *) pc, sizeof(code));
+	pagefault_enable();
+	return !left && !memcmp(code, unw_sigreturn_code, sizeof(code));
+}
+
+/*
+ * Signal frame: the handler returned to the trampoline, the registers
+ * of the interrupted frame are in the sigcontext on the stack. The
+ * trampoline of the process is remembered, the code at pc is only
+ * probed when the unwind would stop otherwise. Returns 1 if pc is not
+ * the trampoline.
+ */
+static int unwind_frame_sigreturn(struct unwind_context *context,
+		struct kunwind_proc_modules *proc, int probe)
+{
+	struct unwind_frame_info *frame = &context->info;
+	unsigned long pc = UNW_PC(frame);
+	struct sigcontext sc;
+
+	if (proc->compat || !pc)
+		return 1;
+	if (pc != READ_ONCE(proc->sigreturn)) {
+		if (!probe || !unw_is_sigreturn(pc))
+			return 1;
+		WRITE_ONCE(proc->sigreturn, pc);
+	}
+	if (unw_stack_read(&context->win, UNW_SP(frame) + UNW_SIGCONTEXT_OFFSET,
+			   &sc, sizeof(sc)))
+		return -EFAULT;
+
+	arch_unw_sigcontext_restore(frame, &sc);
+	/* the interrupted pc is not a return address */
+	frame->call_frame = 0;
+	kunwind_stat_inc(KUNWIND_STAT_SIGNAL_FRAMES);
+	dbug_unwind(3, "sigreturn: rip=%lx rbp=%lx rsp=%lx\n",
+		    UNW_PC(frame), UNW_BP(frame), UNW_SP(frame));
+	return 0;
+}
+#else
+static int unwind_frame_sigreturn(struct unwind_context *context,
+		struct kunwind_proc_modules *proc, int probe)
+{
+	return 1;
+}
+#endif
+
 int unwind_frame(struct unwind_context *context, int user,
 		 struct kunwind_proc_modules *proc)
 {
-	struct kunwind_module *mod = NULL;
+	struct kunwind_mapping *map = NULL;
 	struct unwind_frame_info *frame = &context->info;
 	unsigned long pc = get_pc(frame);
+	u64 start;
 	int res;
 
 	/*
 	 * compat_task is a flag for 32bit process unwinding on a 64-bit
 	 * architecture.  If this flag is set, it means a mapping of
 	 * register numbers is required, as well as being aware of 32-bit
-	 * values on 64-bit registers.
+	 * values on 64-bit registers. It is recorded when the process
+	 * registers, the unwind may run in a sampling context.
 	 */
-	int compat_task = _stp_is_compat_task();
+	int compat_task = proc->compat;
 
 	dbug_unwind(1, "pc=%lx compat_task=%d\n", pc, compat_task);
 
 	if (!pc || !user)
 		return -EINVAL;
 
-	mod = kunw_mod_lookup(pc, proc);
+	/* a known trampoline is cheaper to check than its module */
+	if (!unwind_frame_sigreturn(context, proc, 0))
+		return 0;
 
-	if (mod == NULL)
-		return -EINVAL;
+	map = kunw_mod_lookup(pc, proc, context);
 
-	res = __unwind_frame(context, proc, mod, compat_task);
+	if (map == NULL) {
+		res = -EINVAL;
+		goto sigreturn;
+	}
+	if (!smp_load_acquire(&map->mod))
+		return kunwind_mapping_want(map);
+
+	if (!compat_task && !unwind_frame_fp(context, map)) {
+		kunwind_stat_inc(KUNWIND_STAT_FP_FRAMES);
+		return 0;
+	}
+
+	context->status = 0;
+	start = kunwind_hist_start();
+	res = __unwind_frame(context, map, compat_task);
+	kunwind_hist_end(KUNWIND_HIST_FRAME, start);
 
 	dbug_unwind (2, "unwind_frame returned: %d\n", res);
+	if (res == 0 || res == 2)
+		return res;
+
+sigreturn:
+	/* the trampoline may have no unwind info, or no module at all */
+	if (!unwind_frame_sigreturn(context, proc, 1)) {
+		context->status = 0;
+		return 0;
+	}
 	return res;
 }
 
 
-int unwind_full(struct unwind_context *context,
+/*
+ * Splice the frames of the last backtrace from the matching one, and
+ * make the new backtrace the last one. nr frames were unwound before.
+ */
+static void unwind_tail_splice(struct unwind_context *context,
+		struct kunwind_backtrace *bt, unsigned int j)
+{
+	struct kunwind_tail *tail = context->tail;
+	unsigned int nr = bt->nr_entries;
+	unsigned int n = tail->nr - j;
+
+	memcpy(&bt->entries[nr], &tail->pc[j],
+	       min(n, bt->max_entries - nr) * sizeof(*bt->entries));
+	bt->nr_entries += min(n, bt->max_entries - nr);
+	/* only complete backtraces are kept as tails */
+	bt->status = (n > bt->max_entries - nr) ?
+		KUNWIND_BT_TRUNCATED : KUNWIND_BT_COMPLETE;
+
+	if (nr + n > KUNWIND_MAX_ENTRIES) {
+		tail->nr = 0;
+		return;
+	}
+	memmove(&tail->pc[nr], &tail->pc[j], n * sizeof(*tail->pc));
+	memmove(&tail->sp[nr], &tail->sp[j], n * sizeof(*tail->sp));
+	memcpy(tail->pc, bt->entries, nr * sizeof(*tail->pc));
+	memcpy(tail->sp, context->tail_sp, nr * sizeof(*tail->sp));
+	tail->nr = nr + n;
+}
+
+/* Why the unwind stopped at pc, after unwind_frame() returned ret */
+static unsigned int unwind_status(struct unwind_context *context,
+		unsigned long pc, int ret)
+{
+	if (pc == 0 || ret == 2)
+		return KUNWIND_BT_COMPLETE;
+	switch (ret) {
+	case 0:
+		return KUNWIND_BT_TRUNCATED;
+	case 1:
+		/* the module has no unwind info covering the pc */
+		return KUNWIND_BT_NO_FDE;
+	case -EINVAL:
+		return KUNWIND_BT_NO_MODULE;
+	case -EAGAIN:
+		return KUNWIND_BT_NOT_LOADED;
+	default:
+		return context->status ? context->status : KUNWIND_BT_BAD_CFI;
+	}
+}
+
+/*
+ * Unwind the frames of the context in bt. With a tail, the unwind stops
+ * at the first frame found in the last backtrace of the thread and
+ * takes its outer frames from it, which is a few frames deep instead of
+ * the full depth for threads with a stable stack.
+ */
+static int __unwind_full(struct unwind_context *context,
 		struct kunwind_proc_modules *proc,
 		struct kunwind_backtrace *bt)
 {
-	int ret;
-	unsigned long pc;
+	struct kunwind_tail *tail = context->tail;
+	unsigned int j = 0;
+	unsigned long sp;
+	int ret = 0;
+	unsigned long pc = 0;
 
 	if (!bt->entries || !bt->max_entries)
 		return -EINVAL;
 
 	bt->nr_entries = 0;
+	/* the stack of the previous unwind is stale */
+	context->win.len = 0;
 
 	while (bt->nr_entries < bt->max_entries) {
 		pc = get_pc(&context->info);
@@ -2005,7 +2950,23 @@ int unwind_full(struct unwind_context *context,
 		if (pc == 0)
 			break;
 
+		if (tail && bt->nr_entries < KUNWIND_MAX_ENTRIES) {
+			/* sp grows towards the outer frames */
+			sp = UNW_SP(&context->info);
+			while (j < tail->nr && tail->sp[j] < sp)
+				j++;
+			if (j < tail->nr && tail->sp[j] == sp
+			    && tail->pc[j] == pc) {
+				unwind_tail_splice(context, bt, j);
+				kunwind_stat_inc(KUNWIND_STAT_END_SPLICED);
+				kunwind_stat_inc(KUNWIND_STAT_END + bt->status);
+				return 0;
+			}
+			context->tail_sp[bt->nr_entries] = sp;
+		}
+
 		bt->entries[bt->nr_entries++] = pc;
+		kunwind_stat_inc(KUNWIND_STAT_FRAMES);
 		dbug_unwind(1, "nr_entries %u, ip %p\n", bt->nr_entries, (void *) pc);
 
 		ret = unwind_frame(context, 1, proc);
@@ -2014,54 +2975,96 @@ int unwind_full(struct unwind_context *context,
 			break;
 	}
 
+	/* only a complete backtrace can be spliced in later ones */
+	if (tail) {
+		if ((pc == 0 || ret == 2) && bt->nr_entries <= KUNWIND_MAX_ENTRIES) {
+			memcpy(tail->pc, bt->entries,
+			       bt->nr_entries * sizeof(*tail->pc));
+			memcpy(tail->sp, context->tail_sp,
+			       bt->nr_entries * sizeof(*tail->sp));
+			tail->nr = bt->nr_entries;
+		} else {
+			tail->nr = 0;
+		}
+	}
+
+	bt->status = unwind_status(context, pc, ret);
+	kunwind_stat_inc(KUNWIND_STAT_END + bt->status);
+
 	/* The return code 2 indicates that the unwind is completed */
 	if (ret == 2)
 		ret = 0;
 	return ret;
 }
+
+int unwind_full(struct unwind_context *context,
+		struct kunwind_proc_modules *proc,
+		struct kunwind_backtrace *bt)
+{
+	u64 start = kunwind_hist_start();
+	int ret;
+
+	kunwind_stat_inc(KUNWIND_STAT_UNWINDS);
+	ret = __unwind_full(context, proc, bt);
+	kunwind_hist_end(KUNWIND_HIST_UNWIND, start);
+	return ret;
+}
 EXPORT_SYMBOL_GPL(unwind_full);
 
-int eh_frame_from_hdr(void *base, unsigned long vma_start,
-		unsigned long vma_end, int compat, struct section *ehf_hdr,
-		struct section *ehf)
+/*
+ * Locate the eh_frame of a module from its eh_frame_hdr, which must
+ * already be copied in the kernel. The size of the eh_frame is found by
+ * walking its entries in user memory, up to the zero terminator.
+ * The kbuf of ehf is left for the caller to fill.
+ */
+int eh_frame_from_hdr(unsigned long vma_start, unsigned long vma_end,
+		int compat, struct section *ehf_hdr, struct section *ehf)
 {
-	unsigned long eh_addr, eh_off, eh_len, cie_fde_size = 0;
-	const u8* pos;
-	u8 *eh, *ptr, *prev_ptr;
+	unsigned long eh_off, eh_len = 0;
+	const u8 *pos;
 	u8 *hdr = ehf_hdr->kbuf;
 	unsigned long hdr_addr = ehf_hdr->offset;
 	unsigned long hdr_len = ehf_hdr->size;
+	u8 __user *eh;
+	u32 cie_fde_size;
+	u64 cie_fde_size64;
+
+	if (hdr_len < 8 || hdr[0] != 1)
+		return -EINVAL;
 
 	// FIXME -1 tablesize might not be right in following call
 	pos = hdr + 4;
-	eh_addr = read_ptr_sect(&pos, hdr + hdr_len, hdr[1], vma_start, hdr_addr, 1, compat, -1);
-	eh_off = eh_addr - (unsigned long)base;
-	eh = (u8 *) eh_addr;
+	eh_off = read_ptr_sect(&pos, hdr + hdr_len, hdr[1], 0, hdr_addr, 1, compat, -1);
+	if ((hdr[1] & DW_EH_PE_ADJUST) == DW_EH_PE_pcrel)
+		eh_off = eh_off - (unsigned long)hdr + hdr_addr;
+	if (eh_off >= vma_end - vma_start)
+		return -EINVAL;
+	eh = (u8 __user *) (vma_start + eh_off);
 	dbug_unwind(3, "eh: 0x%lx\n", (unsigned long)eh);
 	dbug_unwind(3, "offset: 0x%lx\n", eh_off);
 
 	// Find eh_frame size
-	ptr = prev_ptr = eh;
 	do {
-		cie_fde_size = *((u32 *) ptr);
-		ptr += 4;
+		if (get_user(cie_fde_size, (u32 __user *) (eh + eh_len)))
+			return -EFAULT;
+		eh_len += 4;
 		if (cie_fde_size == 0xffffffff) {
-			cie_fde_size = *((u64 *) ptr);
-			ptr += 8;
+			if (get_user(cie_fde_size64, (u64 __user *) (eh + eh_len)))
+				return -EFAULT;
+			if (cie_fde_size64 > vma_end - vma_start)
+				return -EINVAL;
+			eh_len += 8 + cie_fde_size64;
+		} else {
+			eh_len += cie_fde_size;
 		}
-		ptr += cie_fde_size;
-		eh_len = (unsigned long) ptr - (unsigned long) eh;
-		if (eh_len + vma_start + hdr_addr > vma_end)
-			return -EINVAL;
-		if (prev_ptr >= ptr)
+		if (eh_len > vma_end - vma_start - eh_off || eh_len > U32_MAX)
 			return -EINVAL;
-		prev_ptr = ptr;
 	} while (cie_fde_size);
 
-	ehf->kbuf = eh;
+	ehf->kbuf = NULL;
 	ehf->offset = eh_off;
 	ehf->size = eh_len;
-	ehf->ubuf = ehf_hdr->ubuf - ehf_hdr->offset + ehf->offset; // FIXME: verify
+	ehf->ubuf = eh;
 
 	return 0;
 }
@@ -18,6 +18,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.ARM_pc /* uregs[15] */
 #define UNW_SP(frame)        (frame)->regs.ARM_sp /* uregs[13] */
+#define UNW_BP(frame)        (frame)->regs.ARM_fp /* uregs[11] */
 
 #define STACK_LIMIT(ptr)     (((ptr) - 1) & ~(THREAD_SIZE - 1))
 
@@ -46,6 +47,12 @@
 #define UNW_PC_IDX 15
 #define UNW_SP_IDX 13
 
+/* Registers of the cached rules: r11 is the frame pointer and r14 the
+   link register. Where the frame record lives depends on the ABI and on
+   thumb code, so there is no frame pointer fast path. */
+#define UNW_FP_IDX 11
+#define UNW_RA_IDX 14
+
 /* Use default rules. The stack pointer should be set from the CFA.
    And the instruction pointer should be set from the return address
    column (which normally is the link register (uregs[14]). */
@@ -18,6 +18,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.pc
 #define UNW_SP(frame)        (frame)->regs.sp
+#define UNW_BP(frame)        (frame)->regs.regs[29]
 
 #define STACK_LIMIT(ptr)     (((ptr) - 1) & ~(THREAD_SIZE - 1))
 
@@ -63,6 +64,12 @@
 #define UNW_PC_IDX 32
 #define UNW_SP_IDX 31
 
+/* Registers of the cached rules: x29 is the frame pointer and x30 the
+   link register. The frame record {x29, x30} is not at a fixed offset
+   from the cfa, so there is no frame pointer fast path. */
+#define UNW_FP_IDX 29
+#define UNW_RA_IDX 30
+
 /* Use default rules. The stack pointer should be set from the CFA.
    And the instruction pointer should be set from the return address
    column (which normally is the link register (regs[30]). */
@@ -26,6 +26,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.ip
 #define UNW_SP(frame)        (frame)->regs.sp
+#define UNW_BP(frame)        (frame)->regs.bp
 
 #define UNW_REGISTER_INFO \
 	PTREGS_INFO(ax), \
@@ -42,6 +43,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.eip
 #define UNW_SP(frame)        (frame)->regs.esp
+#define UNW_BP(frame)        (frame)->regs.ebp
 
 #define UNW_REGISTER_INFO \
 	PTREGS_INFO(eax), \
@@ -59,6 +61,12 @@
 #define UNW_PC_IDX 8
 #define UNW_SP_IDX 4
 
+/* Registers of the cached rules, eip is the return address column. The
+   frame record is at ebp but the cfa is 8 above it, not 16, so there is
+   no frame pointer fast path. */
+#define UNW_FP_IDX 5
+#define UNW_RA_IDX UNW_PC_IDX
+
 #define UNW_NR_REAL_REGS 8
 #define UNW_PC_FROM_RA 0 /* Because [e]ip == return address column already. */
 
@@ -18,6 +18,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.nip
 #define UNW_SP(frame)        (frame)->regs.gpr[1]
+#define UNW_BP(frame)        (frame)->regs.gpr[31]
 
 #define STACK_LIMIT(ptr)     (((ptr) - 1) & ~(THREAD_SIZE - 1))
 
@@ -80,6 +81,12 @@
 #define UNW_PC_IDX 35
 #define UNW_SP_IDX 1
 
+/* Registers of the cached rules: r31 is the frame pointer when one is
+   used and the return address is in the link register, saved in the
+   frame of the caller by non leaf functions. */
+#define UNW_FP_IDX 31
+#define UNW_RA_IDX 34
+
 #define UNW_NR_REAL_REGS 35 /* We don't count nip. */
 
 static inline void arch_unw_init_frame_info(struct unwind_frame_info *info,
@@ -18,6 +18,7 @@
 
 #define UNW_PC(frame)        (frame)->regs.psw.addr
 #define UNW_SP(frame)        (frame)->regs.gprs[15]
+#define UNW_BP(frame)        (frame)->regs.gprs[11]
 
 #define STACK_LIMIT(ptr)     (((ptr) - 1) & ~(THREAD_SIZE - 1))
 
@@ -50,6 +51,11 @@
 #define UNW_PC_IDX 16
 #define UNW_SP_IDX 15
 
+/* Registers of the cached rules: r11 is the frame pointer and r14 holds
+   the return address, both saved by stmg in the register save area. */
+#define UNW_FP_IDX 11
+#define UNW_RA_IDX 14
+
 #define UNW_SP_FROM_CFA 0 /* Stack pointer is just gprs15, normal cfi. */
 
 static inline void arch_unw_init_frame_info(struct unwind_frame_info *info,
@@ -52,7 +52,7 @@ static inline int _stp_is_compat_task(void)
 struct section {
 	unsigned long offset;	/* offset from vma start */
 	u8 __user *ubuf;	/* original virtual address of the section */
-	u8 *kbuf;		/* accessible buffer mapped in kernel */
+	u8 *kbuf;		/* copy of the section in kernel */
 	uint32_t size;		/* buffer size in bytes */
 };
 
@@ -406,6 +406,7 @@ struct unwind_reg_state {
 
 struct unwind_state {
 	uleb128_t loc;						/* instruction address */
+	uleb128_t rowLoc;					/* start of the target row */
 	uleb128_t codeAlign;
 	sleb128_t dataAlign;
 	unsigned stackDepth:8;
@@ -413,10 +414,63 @@ struct unwind_state {
 	struct unwind_item cie_regs[ARRAY_SIZE(reg_info)];
 };
 
+struct tdep_item {
+	int where;
+	int reg;
+	long off;
+};
+
+/*
+ * Conditional term of a closed-form cfa expression, added to the cfa
+ * when cfa.where is Expr: ((reg & mask) >= ge) << shift.
+ */
+struct tdep_cond {
+	int reg;
+	unsigned char mask;
+	unsigned char ge;
+	unsigned char shift;
+};
+
+/*
+ * Cached rules, valid for the pc range [start, end) of a CFI row. Only
+ * the frame pointer, the stack pointer and the return address of the
+ * architecture are restored, see check_standard_frame().
+ */
+struct tdep_frame {
+	unsigned long start;
+	unsigned long end;
+	struct tdep_item cfa;
+	struct tdep_item fp;
+	struct tdep_item sp;
+	struct tdep_item ra;
+	struct tdep_cond cond;
+	int last;
+};
+
+struct kunwind_module;
+struct kunwind_mapping;
+
+#define UNW_STACK_WINDOW 1024
+
+/* copy of the user stack, the saved registers are read from it */
+struct unw_stack_window {
+	unsigned long start;	/* user address of buf[0] */
+	unsigned long len;	/* valid bytes, 0 when empty */
+	unsigned long buf[UNW_STACK_WINDOW / sizeof(long)];
+};
+
 struct unwind_context {
     struct unwind_frame_info info;
     struct unwind_frame_info stub;
     struct unwind_state state;
+    /* last mapping hit, consecutive frames often stay in the same one */
+    struct kunwind_mapping *last_map;
+    /* last backtrace of the thread, NULL for a full unwind */
+    struct kunwind_tail *tail;
+    unsigned long *tail_sp;	/* sp of the frames being unwound */
+    struct unw_stack_window win;
+    /* KUNWIND_BT_* reason of the failure of the last frame, 0 if unknown */
+    unsigned int status;
 };
 
 static const struct cfa badCFA = { ARRAY_SIZE(reg_info), 1 };
@@ -436,12 +490,19 @@ struct unwind_cache {
 };
 
 struct kunwind_proc_modules;
+struct kunwind_tail;
 
 int unwind_full(struct unwind_context *context,
 		struct kunwind_proc_modules *proc,
 		struct kunwind_backtrace *bt);
 
-int eh_frame_from_hdr(void *base, unsigned long vma_start,
-		unsigned long vma_end, int compat, struct section *ehf_hdr,
-		struct section *ehf);
+int eh_frame_from_hdr(unsigned long vma_start, unsigned long vma_end,
+		int compat, struct section *ehf_hdr, struct section *ehf);
+
+int fde_table_from_hdr(struct kunwind_module *kunw_mod, int compat_task);
+int unw_table_compile(struct kunwind_module *kunw_mod, int compat_task);
+void *unw_table_export(struct kunwind_module *kunw_mod, int compat_task,
+		u32 *size);
+int unw_table_import(struct kunwind_module *kunw_mod, int compat_task,
+		const void *buf, u32 size);
 #endif /*_STP_UNWIND_H_*/
@@ -20,6 +20,8 @@
 
 #include <linux/sched.h>
 #include <asm/ptrace.h>
+#include <asm/sigcontext.h>
+#include <asm/ucontext.h>
 
 /* these are simple for x86_64 */
 #define _stp_get_unaligned(ptr) (*(ptr))
@@ -36,20 +38,6 @@
 #define UNW_BP(frame)        (frame)->regs.rbp
 #endif /* STAPCONF_X86_UNIREGS */
 
-struct tdep_item {
-	int where;
-	int reg;
-	long off;
-};
-
-struct tdep_frame {
-	unsigned long pc;
-	struct tdep_item cfa;
-	struct tdep_item rbp;
-	struct tdep_item rsp;
-	int last;
-};
-
 /* Might need to account for the special exception and interrupt handling
    stacks here, since normally
 	EXCEPTION_STACK_ORDER < THREAD_ORDER < IRQSTACK_ORDER,
@@ -135,9 +123,53 @@ struct tdep_frame {
 #define UNW_PC_IDX 16
 #define UNW_SP_IDX 7
 
+/* Registers of the cached rules, rip is the return address column */
+#define UNW_FP_IDX RBP
+#define UNW_RA_IDX UNW_PC_IDX
+/* push %rbp; mov %rsp,%rbp leaves the saved rbp and the return address
+   at rbp, right below the cfa of the caller. */
+#define UNW_FP_RECORD 1
+
 #define UNW_NR_REAL_REGS 16
 #define UNW_PC_FROM_RA 0 /* Because rip == return address column already. */
 
+/* rt_sigreturn trampoline: mov $__NR_rt_sigreturn,%rax; syscall */
+#define UNW_SIGRETURN_CODE { 0x48, 0xc7, 0xc0, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x05 }
+/* At the trampoline, sp points to the ucontext of the rt_sigframe */
+#define UNW_SIGCONTEXT_OFFSET offsetof(struct ucontext, uc_mcontext)
+
+/* Registers of the interrupted frame, from the sigcontext of a signal */
+static inline void arch_unw_sigcontext_restore(struct unwind_frame_info *info,
+					       const struct sigcontext *sc)
+{
+	info->regs.r8 = sc->r8;
+	info->regs.r9 = sc->r9;
+	info->regs.r10 = sc->r10;
+	info->regs.r11 = sc->r11;
+	info->regs.r12 = sc->r12;
+	info->regs.r13 = sc->r13;
+	info->regs.r14 = sc->r14;
+	info->regs.r15 = sc->r15;
+	UNW_BP(info) = sc->bp;
+	UNW_SP(info) = sc->sp;
+	UNW_PC(info) = sc->ip;
+#ifdef STAPCONF_X86_UNIREGS
+	info->regs.di = sc->di;
+	info->regs.si = sc->si;
+	info->regs.bx = sc->bx;
+	info->regs.dx = sc->dx;
+	info->regs.ax = sc->ax;
+	info->regs.cx = sc->cx;
+#else
+	info->regs.rdi = sc->di;
+	info->regs.rsi = sc->si;
+	info->regs.rbx = sc->bx;
+	info->regs.rdx = sc->dx;
+	info->regs.rax = sc->ax;
+	info->regs.rcx = sc->cx;
+#endif
+}
+
 static inline void arch_unw_init_frame_info(struct unwind_frame_info *info,
                                             /*const*/ struct pt_regs *regs,
 					    int sanitize)
@@ -3,6 +3,30 @@
 
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/string.h>
+
+#define VDSO_NAME "[vdso]"
+
+/*
+ * The vDSO is an anonymous mapping. Its name comes from the special
+ * mapping, or from the mm context on the architectures that install it
+ * the old way.
+ */
+static inline bool vma_is_vdso(struct vm_area_struct *vma)
+{
+	const char *name = NULL;
+
+	if (vma->vm_file)
+		return false;
+	if (vma->vm_ops && vma->vm_ops->name)
+		name = vma->vm_ops->name(vma);
+#if defined(CONFIG_PPC64) || defined(CONFIG_S390)
+	if (!name && vma->vm_mm
+	    && vma->vm_start == vma->vm_mm->context.vdso_base)
+		return true;
+#endif
+	return name && !strcmp(name, VDSO_NAME);
+}
 
 static inline
 char *vma_file_path(struct vm_area_struct *vma,
@@ -11,9 +35,15 @@ char *vma_file_path(struct vm_area_struct *vma,
 	char *path;
 
 	struct file *file = vma->vm_file;
-	if (!file) return NULL;
+	if (!file) {
+		if (!vma_is_vdso(vma))
+			return NULL;
+		strlcpy(buf, VDSO_NAME, buflen);
+		return buf;
+	}
 
-	path = dentry_path_raw(file->f_path.dentry, buf, buflen);
+	/* from the root of the process, across the mounts */
+	path = d_path(&file->f_path, buf, buflen);
 
 	if (IS_ERR(path))
 		return NULL;